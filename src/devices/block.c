@@ -1,9 +1,16 @@
 #include "devices/block.h"
+#include <block-stats.h>
 #include <list.h>
+#include <round.h>
 #include <string.h>
 #include <stdio.h>
 #include "devices/ide.h"
+#include "devices/timer.h"
+#include "threads/interrupt.h"
 #include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
 
 /* A block device. */
 struct block
@@ -19,6 +26,11 @@ struct block
 
     unsigned long long read_cnt;        /* Number of sectors read. */
     unsigned long long write_cnt;       /* Number of sectors written. */
+
+    /* Request statistics, updated with interrupts off. */
+    struct block_stats stats;           /* Counters and histograms. */
+    uint64_t first_request;             /* Cycle of the first request. */
+    uint64_t last_change;               /* Cycle stats.depth last changed. */
   };
 
 /* List of all block devices. */
@@ -27,7 +39,22 @@ static struct list all_blocks = LIST_INITIALIZER (all_blocks);
 /* The block block assigned to each Pintos role. */
 static struct block *block_by_role[BLOCK_ROLE_CNT];
 
+/* Block I/O trace: a ring of the most recently completed
+   requests, recorded with interrupts off.  TRACE is null unless
+   tracing was requested with block_trace_configure(). */
+#define TRACE_DEFAULT_CNT 8192
+static size_t trace_cnt;                /* Capacity of TRACE. */
+static struct block_trace_entry *trace; /* Ring of entries. */
+static unsigned long long trace_total;  /* Entries ever recorded. */
+static bool trace_stopped;              /* No longer recording? */
+static uint64_t trace_start_cycles;     /* TSC when tracing began. */
+static int64_t trace_start_ticks;       /* Timer tick when it began. */
+static struct block_trace_header trace_header; /* Filled when stopped. */
+
 static struct block *list_elem_to_block (struct list_elem *);
+static void wake_submitter (struct block_request *);
+static void dispatch (struct block *, struct block_request *);
+static void change_depth (struct block *, int delta, uint64_t now);
 
 /* Returns a human-readable name for the given block device
    TYPE. */
@@ -113,6 +140,89 @@ check_sector (struct block *block, block_sector_t sector)
     }
 }
 
+/* Transfers the CNT sectors starting at SECTOR between BLOCK and
+   BUFFER, writing if WRITE is true and reading otherwise, and
+   returns when the transfer is done.  TAG says who asked for it.
+   Does nothing if CNT is 0. */
+void
+block_transfer (struct block *block, block_sector_t sector, size_t cnt,
+                void *buffer, bool write, enum block_tag tag)
+{
+  struct block_request req;
+  struct semaphore done;
+
+  if (cnt == 0)
+    return;
+
+  sema_init (&done, 0);
+  req.sector = sector;
+  req.cnt = cnt;
+  req.buffer = buffer;
+  req.write = write;
+  req.complete = wake_submitter;
+  req.aux = &done;
+  req.tag = tag;
+  block_submit (block, &req);
+  sema_down (&done);
+}
+
+/* Completion function for the requests made by block_transfer(). */
+static void
+wake_submitter (struct block_request *req)
+{
+  sema_up (req->aux);
+}
+
+/* Checks that the CNT sectors starting at SECTOR lie within
+   BLOCK and may be written if WRITE is true, and counts them in
+   BLOCK's statistics. */
+static void
+check_transfer (struct block *block, block_sector_t sector, size_t cnt,
+                bool write)
+{
+  ASSERT (cnt > 0);
+  check_sector (block, sector);
+  check_sector (block, sector + cnt - 1);
+  if (write)
+    {
+      ASSERT (block->type != BLOCK_FOREIGN);
+      block->write_cnt += cnt;
+    }
+  else
+    block->read_cnt += cnt;
+}
+
+/* Hands REQ, already checked, to BLOCK's driver.  A driver that
+   does not queue requests does the transfer right away, after
+   which REQ is completed. */
+static void
+dispatch (struct block *block, struct block_request *req)
+{
+  const struct block_operations *ops = block->ops;
+  uint8_t *p = req->buffer;
+  size_t i;
+
+  if (ops->submit != NULL)
+    {
+      ops->submit (block->aux, req);
+      return;
+    }
+
+  if (req->write && ops->write_multiple != NULL)
+    ops->write_multiple (block->aux, req->sector, req->cnt, req->buffer);
+  else if (!req->write && ops->read_multiple != NULL)
+    ops->read_multiple (block->aux, req->sector, req->cnt, req->buffer);
+  else
+    for (i = 0; i < req->cnt; i++)
+      {
+        if (req->write)
+          ops->write (block->aux, req->sector + i, p + i * BLOCK_SECTOR_SIZE);
+        else
+          ops->read (block->aux, req->sector + i, p + i * BLOCK_SECTOR_SIZE);
+      }
+  block_complete (req);
+}
+
 /* Reads sector SECTOR from BLOCK into BUFFER, which must
    have room for BLOCK_SECTOR_SIZE bytes.
    Internally synchronizes accesses to block devices, so external
@@ -120,9 +230,7 @@ check_sector (struct block *block, block_sector_t sector)
 void
 block_read (struct block *block, block_sector_t sector, void *buffer)
 {
-  check_sector (block, sector);
-  block->ops->read (block->aux, sector, buffer);
-  block->read_cnt++;
+  block_transfer (block, sector, 1, buffer, false, BLOCK_TAG_OTHER);
 }
 
 /* Write sector SECTOR to BLOCK from BUFFER, which must contain
@@ -133,10 +241,49 @@ block_read (struct block *block, block_sector_t sector, void *buffer)
 void
 block_write (struct block *block, block_sector_t sector, const void *buffer)
 {
-  check_sector (block, sector);
-  ASSERT (block->type != BLOCK_FOREIGN);
-  block->ops->write (block->aux, sector, buffer);
-  block->write_cnt++;
+  block_transfer (block, sector, 1, (void *) buffer, true, BLOCK_TAG_OTHER);
+}
+
+/* Reads the CNT consecutive sectors starting at SECTOR from
+   BLOCK into BUFFER, which must have room for CNT *
+   BLOCK_SECTOR_SIZE bytes. */
+void
+block_read_multiple (struct block *block, block_sector_t sector, size_t cnt,
+                     void *buffer)
+{
+  block_transfer (block, sector, cnt, buffer, false, BLOCK_TAG_OTHER);
+}
+
+/* Writes the CNT consecutive sectors starting at SECTOR to BLOCK
+   from BUFFER, which must contain CNT * BLOCK_SECTOR_SIZE bytes.
+   Returns after the block device has acknowledged receiving the
+   data. */
+void
+block_write_multiple (struct block *block, block_sector_t sector, size_t cnt,
+                      const void *buffer)
+{
+  block_transfer (block, sector, cnt, (void *) buffer, true,
+                  BLOCK_TAG_OTHER);
+}
+
+/* Starts the transfer described by REQ on BLOCK and returns,
+   usually before it is done; REQ->complete is called when it
+   is.  On a driver that does not queue requests, the transfer
+   is done and completed before returning. */
+void
+block_submit (struct block *block, struct block_request *req)
+{
+  enum intr_level old_level;
+
+  check_transfer (block, req->sector, req->cnt, req->write);
+
+  req->block = block;
+  old_level = intr_disable ();
+  req->start = timer_cycles ();
+  change_depth (block, 1, req->start);
+  intr_set_level (old_level);
+
+  dispatch (block, req);
 }
 
 /* Returns the number of sectors in BLOCK. */
@@ -160,6 +307,38 @@ block_type (struct block *block)
   return block->type;
 }
 
+/* Copies BLOCK's request statistics into STATS, bringing its
+   time-based counters up to date first. */
+static void
+snapshot_stats (struct block *block, struct block_stats *stats)
+{
+  enum intr_level old_level = intr_disable ();
+  uint64_t now = timer_cycles ();
+
+  change_depth (block, 0, now);
+  *stats = block->stats;
+  if (block->first_request != 0)
+    stats->elapsed_cycles = now - block->first_request;
+  intr_set_level (old_level);
+}
+
+/* Prints the nonempty buckets of latency histogram HIST for
+   BLOCK, whose requests in that direction are described by
+   WHAT. */
+static void
+print_histogram (struct block *block, const char *what,
+                 const unsigned long long hist[BLOCK_STATS_BUCKETS])
+{
+  int i;
+
+  printf ("%s (%s): %s latency (log2 cycles):",
+          block->name, block_type_name (block->type), what);
+  for (i = 0; i < BLOCK_STATS_BUCKETS; i++)
+    if (hist[i] != 0)
+      printf (" %d:%llu", i, hist[i]);
+  printf ("\n");
+}
+
 /* Prints statistics for each block device used for a Pintos role. */
 void
 block_print_stats (void)
@@ -169,12 +348,177 @@ block_print_stats (void)
   for (i = 0; i < BLOCK_ROLE_CNT; i++)
     {
       struct block *block = block_by_role[i];
-      if (block != NULL)
+      struct block_stats stats;
+      unsigned long long avg_depth;
+
+      if (block == NULL)
+        continue;
+
+      printf ("%s (%s): %llu reads, %llu writes\n",
+              block->name, block_type_name (block->type),
+              block->read_cnt, block->write_cnt);
+
+      snapshot_stats (block, &stats);
+      if (stats.elapsed_cycles == 0)
+        continue;
+
+      /* Average queue depth, in hundredths. */
+      avg_depth = stats.depth_cycles * 100 / stats.elapsed_cycles;
+      printf ("%s (%s): %llu read requests, %llu write requests, "
+              "queue depth %llu.%02llu avg, %u max, busy %llu%%\n",
+              block->name, block_type_name (block->type),
+              stats.requests[0], stats.requests[1],
+              avg_depth / 100, avg_depth % 100, stats.max_depth,
+              stats.busy_cycles * 100 / stats.elapsed_cycles);
+      if (stats.requests[0] != 0)
+        print_histogram (block, "read", stats.latency[0]);
+      if (stats.requests[1] != 0)
+        print_histogram (block, "write", stats.latency[1]);
+    }
+}
+
+/* Copies the request statistics of the block device fulfilling
+   ROLE into STATS.  Returns false if no block device has been
+   assigned that role. */
+bool
+block_get_stats (enum block_type role, struct block_stats *stats)
+{
+  struct block *block = block_get_role (role);
+  if (block == NULL)
+    return false;
+  snapshot_stats (block, stats);
+  return true;
+}
+
+/* Sets up tracing of block requests into a ring of CNT entries,
+   or a default number if CNT is 0.  Takes effect when
+   block_trace_init() is called. */
+void
+block_trace_configure (size_t cnt)
+{
+  trace_cnt = cnt != 0 ? cnt : TRACE_DEFAULT_CNT;
+}
+
+/* Allocates the trace ring, if tracing was configured, and starts
+   recording. */
+void
+block_trace_init (void)
+{
+  size_t page_cnt;
+
+  if (trace_cnt == 0)
+    return;
+
+  page_cnt = DIV_ROUND_UP (trace_cnt * sizeof *trace, PGSIZE);
+  trace = palloc_get_multiple (0, page_cnt);
+  if (trace == NULL)
+    PANIC ("can't allocate %zu-entry block trace", trace_cnt);
+  trace_start_cycles = timer_cycles ();
+  trace_start_ticks = timer_ticks ();
+}
+
+/* Records completed request REQ, which took LATENCY cycles, in
+   the trace.  Interrupts must be off. */
+static void
+trace_request (const struct block_request *req, uint64_t latency)
+{
+  struct block_trace_entry *e;
+  int role;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  if (trace == NULL || trace_stopped)
+    return;
+
+  for (role = 0; role < BLOCK_ROLE_CNT; role++)
+    if (block_by_role[role] == req->block)
+      break;
+  if (role == BLOCK_ROLE_CNT)
+    role = req->block->type;
+
+  e = &trace[trace_total++ % trace_cnt];
+  e->start = req->start - trace_start_cycles;
+  e->latency = latency < UINT32_MAX ? latency : UINT32_MAX;
+  e->sector = req->sector;
+  e->cnt = req->cnt;
+  e->role = role;
+  e->tag = req->tag;
+  e->write = req->write;
+  memset (e->reserved, 0, sizeof e->reserved);
+}
+
+/* Stops recording block requests and returns the size in bytes
+   of the trace, as read by block_trace_read(), or 0 if tracing
+   is not enabled. */
+size_t
+block_trace_stop (void)
+{
+  struct block_trace_header *h = &trace_header;
+  enum intr_level old_level;
+  int64_t ticks;
+
+  if (trace == NULL)
+    return 0;
+
+  old_level = intr_disable ();
+  if (!trace_stopped)
+    {
+      trace_stopped = true;
+      ticks = timer_ticks () - trace_start_ticks;
+      h->magic = BLOCK_TRACE_MAGIC;
+      h->version = BLOCK_TRACE_VERSION;
+      h->entry_cnt = trace_total < trace_cnt ? trace_total : trace_cnt;
+      h->lost_cnt = trace_total - h->entry_cnt;
+      h->cycles_per_tick = (ticks > 0
+                            ? (timer_cycles () - trace_start_cycles) / ticks
+                            : 0);
+      h->timer_freq = TIMER_FREQ;
+      h->reserved = 0;
+    }
+  intr_set_level (old_level);
+
+  return sizeof *h + h->entry_cnt * sizeof *trace;
+}
+
+/* Copies SIZE bytes of the trace, starting at byte offset OFS,
+   into BUFFER.  The trace consists of a struct
+   block_trace_header followed by its entries, oldest first.
+   block_trace_stop() must have been called. */
+void
+block_trace_read (void *buffer_, size_t ofs, size_t size)
+{
+  const struct block_trace_header *h = &trace_header;
+  unsigned long long first = trace_total - h->entry_cnt;
+  uint8_t *buffer = buffer_;
+
+  ASSERT (trace_stopped);
+
+  while (size > 0)
+    {
+      const uint8_t *src;
+      size_t chunk;
+
+      if (ofs < sizeof *h)
         {
-          printf ("%s (%s): %llu reads, %llu writes\n",
-                  block->name, block_type_name (block->type),
-                  block->read_cnt, block->write_cnt);
+          src = (const uint8_t *) h + ofs;
+          chunk = sizeof *h - ofs;
         }
+      else
+        {
+          size_t idx = (ofs - sizeof *h) / sizeof *trace;
+          size_t within = (ofs - sizeof *h) % sizeof *trace;
+
+          ASSERT (idx < h->entry_cnt);
+          src = (const uint8_t *) &trace[(first + idx) % trace_cnt] + within;
+          chunk = sizeof *trace - within;
+        }
+      if (chunk > size)
+        chunk = size;
+
+      memcpy (buffer, src, chunk);
+      buffer += chunk;
+      ofs += chunk;
+      size -= chunk;
     }
 }
 
@@ -200,6 +544,9 @@ block_register (const char *name, enum block_type type,
   block->aux = aux;
   block->read_cnt = 0;
   block->write_cnt = 0;
+  memset (&block->stats, 0, sizeof block->stats);
+  block->first_request = 0;
+  block->last_change = 0;
 
   printf ("%s: %'"PRDSNu" sectors (", block->name, block->size);
   print_human_readable_size ((uint64_t) block->size * BLOCK_SECTOR_SIZE);
@@ -211,6 +558,72 @@ block_register (const char *name, enum block_type type,
   return block;
 }
 
+/* Passes REQ, which a driver received for one of its own
+   devices, on to BLOCK without accounting it there a second
+   time.  For drivers, like partitions, that sit on top of
+   another block device. */
+void
+block_forward (struct block *block, struct block_request *req)
+{
+  check_transfer (block, req->sector, req->cnt, req->write);
+  dispatch (block, req);
+}
+
+/* Called by drivers when they finish REQ.  Records its latency
+   against the block device it was submitted to and calls
+   REQ->complete, after which REQ must not be touched. */
+void
+block_complete (struct block_request *req)
+{
+  struct block *block = req->block;
+  struct block_stats *stats = &block->stats;
+  int dir = req->write ? 1 : 0;
+  enum intr_level old_level;
+  uint64_t now, latency;
+  int bucket;
+
+  old_level = intr_disable ();
+  now = timer_cycles ();
+  latency = now - req->start;
+  for (bucket = 0; latency >> bucket > 1 && bucket < BLOCK_STATS_BUCKETS - 1;
+       bucket++)
+    continue;
+  stats->requests[dir]++;
+  stats->sectors[dir] += req->cnt;
+  stats->latency_cycles[dir] += latency;
+  stats->latency[dir][bucket]++;
+  change_depth (block, -1, now);
+  trace_request (req, latency);
+  intr_set_level (old_level);
+
+  req->complete (req);
+}
+
+/* Adds DELTA to the number of requests in flight on BLOCK at
+   cycle NOW, first crediting the time since the last change to
+   the busy and queue depth counters.  Interrupts must be off. */
+static void
+change_depth (struct block *block, int delta, uint64_t now)
+{
+  struct block_stats *stats = &block->stats;
+  uint64_t span = now - block->last_change;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  if (stats->depth > 0)
+    {
+      stats->busy_cycles += span;
+      stats->depth_cycles += span * stats->depth;
+    }
+  if (block->first_request == 0 && delta > 0)
+    block->first_request = now;
+  block->last_change = now;
+
+  stats->depth += delta;
+  if (stats->depth > stats->max_depth)
+    stats->max_depth = stats->depth;
+}
+
 /* Returns the block device corresponding to LIST_ELEM, or a null
    pointer if LIST_ELEM is the list end of all_blocks. */
 static struct block *
@@ -1,6 +1,9 @@
 #ifndef DEVICES_BLOCK_H
 #define DEVICES_BLOCK_H
 
+#include <block-trace.h>
+#include <list.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <inttypes.h>
 
@@ -53,22 +56,75 @@ struct block *block_next (struct block *);
 block_sector_t block_size (struct block *);
 void block_read (struct block *, block_sector_t, void *);
 void block_write (struct block *, block_sector_t, const void *);
+void block_read_multiple (struct block *, block_sector_t, size_t, void *);
+void block_write_multiple (struct block *, block_sector_t, size_t,
+                           const void *);
+void block_transfer (struct block *, block_sector_t, size_t, void *,
+                     bool write, enum block_tag);
 const char *block_name (struct block *);
 enum block_type block_type (struct block *);
 
+/* An asynchronous request to transfer CNT consecutive sectors
+   between a block device and BUFFER.  The submitter fills in all
+   but the members marked as belonging to the block layer, which
+   may change them, and must keep the request and BUFFER alive
+   until COMPLETE is called.  COMPLETE runs in a kernel thread,
+   typically the driver's, so it may acquire locks but should
+   not sleep on anything else for long. */
+struct block_request
+  {
+    block_sector_t sector;              /* First sector. */
+    size_t cnt;                         /* Number of sectors. */
+    void *buffer;                       /* CNT * BLOCK_SECTOR_SIZE bytes. */
+    bool write;                         /* Write (true) or read (false)? */
+    void (*complete) (struct block_request *); /* Called when done. */
+    void *aux;                          /* For COMPLETE's use. */
+    enum block_tag tag;                 /* Issuer, for tracing. */
+
+    /* Owned by the block layer and drivers. */
+    struct list_elem elem;              /* Element in a driver queue. */
+    void *dev;                          /* Driver's device. */
+    int64_t deadline;                   /* Tick by which to serve it. */
+    struct block *block;                /* Device it was submitted to. */
+    uint64_t start;                     /* CPU cycle it was submitted. */
+  };
+
+void block_submit (struct block *, struct block_request *);
+
 /* Statistics. */
+struct block_stats;
 void block_print_stats (void);
+bool block_get_stats (enum block_type role, struct block_stats *);
+
+/* Tracing. */
+void block_trace_configure (size_t cnt);
+void block_trace_init (void);
+size_t block_trace_stop (void);
+void block_trace_read (void *, size_t ofs, size_t size);
 
 /* Lower-level interface to block device drivers. */
 
+/* A driver either queues requests itself, through SUBMIT, or
+   leaves SUBMIT null and provides READ and WRITE, which the block
+   layer calls synchronously.  READ_MULTIPLE and WRITE_MULTIPLE
+   transfer a run of CNT consecutive sectors at once.  They may
+   be null, in which case the block layer transfers the run one
+   sector at a time. */
 struct block_operations
   {
     void (*read) (void *aux, block_sector_t, void *buffer);
     void (*write) (void *aux, block_sector_t, const void *buffer);
+    void (*read_multiple) (void *aux, block_sector_t, size_t cnt,
+                           void *buffer);
+    void (*write_multiple) (void *aux, block_sector_t, size_t cnt,
+                            const void *buffer);
+    void (*submit) (void *aux, struct block_request *);
   };
 
 struct block *block_register (const char *name, enum block_type,
                               const char *extra_info, block_sector_t size,
                               const struct block_operations *, void *aux);
+void block_forward (struct block *, struct block_request *);
+void block_complete (struct block_request *);
 
 #endif /* devices/block.h */
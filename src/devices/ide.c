@@ -3,15 +3,34 @@
 #include <debug.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include "devices/block.h"
 #include "devices/partition.h"
+#include "devices/pci.h"
 #include "devices/timer.h"
 #include "threads/io.h"
 #include "threads/interrupt.h"
 #include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
 
 /* The code in this file is an interface to an ATA (IDE)
-   controller.  It attempts to comply to [ATA-3]. */
+   controller.  It attempts to comply to [ATA-3].  Transfers use
+   bus-master DMA, as described in [SFF-8038i], when the
+   controller and disk support it, and PIO otherwise.
+
+   Requests are queued per channel and served one at a time by
+   the channel's worker thread, the only thread that touches the
+   controller once the disks are identified.  The worker serves
+   them in C-LOOK order, ascending by sector and then wrapping
+   around, except that a request waiting past its deadline is
+   served first.  Reads get a shorter deadline than writes,
+   because a thread usually waits for its reads. */
+
+/* Ticks a request may wait before it is served ahead of the
+   C-LOOK order. */
+#define READ_DEADLINE (TIMER_FREQ / 10)
+#define WRITE_DEADLINE (TIMER_FREQ)
 
 /* ATA command block port addresses. */
 #define reg_data(CHANNEL) ((CHANNEL)->reg_base + 0)     /* Data. */
@@ -30,10 +49,25 @@
 #define reg_ctl(CHANNEL) ((CHANNEL)->reg_base + 0x206)  /* Control (w/o). */
 #define reg_alt_status(CHANNEL) reg_ctl (CHANNEL)       /* Alt Status (r/o). */
 
+/* Bus master IDE port addresses, found through PCI. */
+#define reg_bm_command(CHANNEL) ((CHANNEL)->bm_base + 0) /* Command. */
+#define reg_bm_status(CHANNEL) ((CHANNEL)->bm_base + 2)  /* Status. */
+#define reg_bm_prdt(CHANNEL) ((CHANNEL)->bm_base + 4)    /* PRD table address. */
+
+/* Bus master Command Register bits. */
+#define BM_CMD_START 0x01       /* Start transfer. */
+#define BM_CMD_READ 0x08        /* Transfer from disk to memory. */
+
+/* Bus master Status Register bits.  ERR and INTR are cleared by
+   writing 1 to them. */
+#define BM_STA_ERR 0x02         /* Transfer failed. */
+#define BM_STA_INTR 0x04        /* Disk interrupted. */
+
 /* Alternate Status Register bits. */
 #define STA_BSY 0x80            /* Busy. */
 #define STA_DRDY 0x40           /* Device Ready. */
 #define STA_DRQ 0x08            /* Data Request. */
+#define STA_ERR 0x01            /* Error. */
 
 /* Control Register bits. */
 #define CTL_SRST 0x04           /* Software Reset. */
@@ -49,6 +83,12 @@
 #define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
+#define CMD_READ_DMA 0xc8               /* READ DMA. */
+#define CMD_WRITE_DMA 0xca              /* WRITE DMA. */
+
+/* Most sectors transferred by one READ or WRITE SECTOR command,
+   which takes its count in an 8-bit register where 0 means 256. */
+#define MAX_SECTORS_PER_COMMAND 256
 
 /* An ATA device. */
 struct ata_disk
@@ -57,8 +97,26 @@ struct ata_disk
     struct channel *channel;    /* Channel that disk is attached to. */
     int dev_no;                 /* Device 0 or 1 for master or slave. */
     bool is_ata;                /* Is device an ATA disk? */
+    bool use_dma;               /* Transfer by bus-master DMA? */
+  };
+
+/* A Physical Region Descriptor, telling the bus master where one
+   piece of a DMA transfer goes in memory.  A region may not
+   cross a 64 kB boundary. */
+struct prd
+  {
+    uint32_t addr;              /* Physical address. */
+    uint16_t size;              /* Size in bytes; 0 means 64 kB. */
+    uint16_t flags;             /* PRD_EOT on the last descriptor. */
   };
 
+#define PRD_EOT 0x8000          /* End of table. */
+#define PRD_BOUNDARY 0x10000    /* Regions may not cross multiples of this. */
+
+/* PRD table entries per channel.  A transfer of
+   MAX_SECTORS_PER_COMMAND sectors spans at most 3 regions. */
+#define PRD_CNT 4
+
 /* An ATA channel (aka controller).
    Each channel can control up to two disks. */
 struct channel
@@ -67,11 +125,20 @@ struct channel
     uint16_t reg_base;          /* Base I/O port. */
     uint8_t irq;                /* Interrupt in use. */
 
-    struct lock lock;           /* Must acquire to access the controller. */
+    struct lock lock;           /* Protects QUEUE and HEAD. */
+    struct condition queue_not_empty;   /* Signaled when a request is queued. */
+    struct list queue;          /* Pending block_requests, oldest first. */
+    uint64_t head;              /* Position just past the last request served. */
+
     bool expecting_interrupt;   /* True if an interrupt is expected, false if
                                    any interrupt would be spurious. */
     struct semaphore completion_wait;   /* Up'd by interrupt handler. */
 
+    uint16_t bm_base;           /* Bus master base port, or 0 if none. */
+    struct prd prdt[PRD_CNT]    /* PRD table, aligned so as not to */
+      __attribute__ ((aligned (PRD_CNT * sizeof (struct prd))));
+                                /* cross a 64 kB boundary. */
+
     struct ata_disk devices[2];     /* The devices on this channel. */
   };
 
@@ -85,8 +152,20 @@ static void reset_channel (struct channel *);
 static bool check_device_type (struct ata_disk *);
 static void identify_ata_device (struct ata_disk *);
 
-static void select_sector (struct ata_disk *, block_sector_t);
-static void issue_pio_command (struct channel *, uint8_t command);
+static void channel_worker (void *channel_);
+static struct block_request *pick_request (struct channel *);
+static void serve_request (struct block_request *);
+
+static uint16_t find_bus_master (void);
+static bool dma_transfer (struct ata_disk *, block_sector_t, size_t cnt,
+                          const void *buffer, bool write);
+static void pio_read (struct ata_disk *, block_sector_t, size_t cnt,
+                      uint8_t *buffer);
+static void pio_write (struct ata_disk *, block_sector_t, size_t cnt,
+                       const uint8_t *buffer);
+
+static void select_sector (struct ata_disk *, block_sector_t, size_t cnt);
+static void issue_command (struct channel *, uint8_t command);
 static void input_sector (struct channel *, void *);
 static void output_sector (struct channel *, const void *);
 
@@ -101,6 +180,7 @@ static void interrupt_handler (struct intr_frame *);
 void
 ide_init (void) 
 {
+  uint16_t bm_base = find_bus_master ();
   size_t chan_no;
 
   for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
@@ -124,8 +204,12 @@ ide_init (void)
           NOT_REACHED ();
         }
       lock_init (&c->lock);
+      cond_init (&c->queue_not_empty);
+      list_init (&c->queue);
+      c->head = 0;
       c->expecting_interrupt = false;
       sema_init (&c->completion_wait, 0);
+      c->bm_base = bm_base != 0 ? bm_base + 8 * chan_no : 0;
  
       /* Initialize devices. */
       for (dev_no = 0; dev_no < 2; dev_no++)
@@ -136,6 +220,7 @@ ide_init (void)
           d->channel = c;
           d->dev_no = dev_no;
           d->is_ata = false;
+          d->use_dma = false;
         }
 
       /* Register interrupt handler. */
@@ -148,6 +233,10 @@ ide_init (void)
       if (check_device_type (&c->devices[0]))
         check_device_type (&c->devices[1]);
 
+      /* Start serving requests, which registering a disk makes
+         when it scans the disk's partition table. */
+      thread_create (c->name, PRI_DEFAULT, channel_worker, c);
+
       /* Read hard disk identity information. */
       for (dev_no = 0; dev_no < 2; dev_no++)
         if (c->devices[dev_no].is_ata)
@@ -272,7 +361,7 @@ identify_ata_device (struct ata_disk *d)
      indicating the device's response is ready, and read the data
      into our buffer. */
   select_device_wait (d);
-  issue_pio_command (c, CMD_IDENTIFY_DEVICE);
+  issue_command (c, CMD_IDENTIFY_DEVICE);
   sema_down (&c->completion_wait);
   if (!wait_while_busy (d))
     {
@@ -289,6 +378,12 @@ identify_ata_device (struct ata_disk *d)
   snprintf (extra_info, sizeof extra_info,
             "model \"%s\", serial \"%s\"", model, serial);
 
+  /* Use DMA if the disk supports it (word 49, bit 8) and the
+     controller is a bus master. */
+  d->use_dma = c->bm_base != 0 && (*(uint16_t *) &id[49 * 2] & 0x0100) != 0;
+  if (d->use_dma)
+    strlcat (extra_info, ", DMA", sizeof extra_info);
+
   /* Disable access to IDE disks over 1 GB, which are likely
      physical IDE disks rather than virtual ones.  If we don't
      allow access to those, we're less likely to scribble on
@@ -337,63 +432,299 @@ descramble_ata_string (char *string, int size)
   return string;
 }
 
-/* Reads sector SEC_NO from disk D into BUFFER, which must have
-   room for BLOCK_SECTOR_SIZE bytes.
-   Internally synchronizes accesses to disks, so external
-   per-disk locking is unneeded. */
+/* Queues REQ for disk D and returns.  The channel's worker
+   thread completes REQ once the transfer is done. */
 static void
-ide_read (void *d_, block_sector_t sec_no, void *buffer)
+ide_submit (void *d_, struct block_request *req)
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
+
+  ASSERT (req->sector + req->cnt <= (1UL << 28));
+
+  req->dev = d;
+  req->deadline = timer_ticks () + (req->write ? WRITE_DEADLINE : READ_DEADLINE);
+
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_READ_SECTOR_RETRY);
-  sema_down (&c->completion_wait);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-  input_sector (c, buffer);
+  list_push_back (&c->queue, &req->elem);
+  cond_signal (&c->queue_not_empty, &c->lock);
   lock_release (&c->lock);
 }
 
-/* Write sector SEC_NO to disk D from BUFFER, which must contain
-   BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
-   acknowledged receiving the data.
-   Internally synchronizes accesses to disks, so external
-   per-disk locking is unneeded. */
+static struct block_operations ide_operations =
+  {
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    ide_submit
+  };
+
+/* Returns REQ's position in the C-LOOK order of its channel: its
+   disk, then its first sector. */
+static uint64_t
+request_position (const struct block_request *req)
+{
+  const struct ata_disk *d = req->dev;
+  return ((uint64_t) d->dev_no << 32) | req->sector;
+}
+
+/* Serves the requests queued on channel CHANNEL_, forever. */
 static void
-ide_write (void *d_, block_sector_t sec_no, const void *buffer)
+channel_worker (void *channel_)
+{
+  struct channel *c = channel_;
+
+  for (;;)
+    {
+      struct block_request *req;
+
+      lock_acquire (&c->lock);
+      while (list_empty (&c->queue))
+        cond_wait (&c->queue_not_empty, &c->lock);
+      req = pick_request (c);
+      list_remove (&req->elem);
+      c->head = request_position (req) + req->cnt;
+      lock_release (&c->lock);
+
+      serve_request (req);
+      block_complete (req);
+    }
+}
+
+/* Chooses the next request to serve from channel C's queue,
+   which must not be empty: the oldest one if it is past its
+   deadline, otherwise the first at or after C->head in C-LOOK
+   order.  C's lock must be held. */
+static struct block_request *
+pick_request (struct channel *c)
+{
+  struct block_request *oldest, *next = NULL, *lowest = NULL;
+  struct list_elem *e;
+
+  ASSERT (lock_held_by_current_thread (&c->lock));
+  ASSERT (!list_empty (&c->queue));
+
+  oldest = list_entry (list_front (&c->queue), struct block_request, elem);
+  if (timer_ticks () >= oldest->deadline)
+    return oldest;
+
+  for (e = list_begin (&c->queue); e != list_end (&c->queue);
+       e = list_next (e))
+    {
+      struct block_request *req = list_entry (e, struct block_request, elem);
+      uint64_t pos = request_position (req);
+
+      if (pos >= c->head
+          && (next == NULL || pos < request_position (next)))
+        next = req;
+      if (lowest == NULL || pos < request_position (lowest))
+        lowest = req;
+    }
+
+  return next != NULL ? next : lowest;
+}
+
+/* Transfers REQ between its disk and memory, by DMA if possible
+   and by PIO otherwise.  Each command transfers up to
+   MAX_SECTORS_PER_COMMAND sectors.  Must be called by the disk's
+   channel worker. */
+static void
+serve_request (struct block_request *req)
+{
+  struct ata_disk *d = req->dev;
+  block_sector_t sec_no = req->sector;
+  size_t cnt = req->cnt;
+  uint8_t *p = req->buffer;
+
+  while (cnt > 0)
+    {
+      size_t n = cnt < MAX_SECTORS_PER_COMMAND ? cnt : MAX_SECTORS_PER_COMMAND;
+
+      if (!dma_transfer (d, sec_no, n, p, req->write))
+        {
+          if (req->write)
+            pio_write (d, sec_no, n, p);
+          else
+            pio_read (d, sec_no, n, p);
+        }
+      sec_no += n;
+      p += n * BLOCK_SECTOR_SIZE;
+      cnt -= n;
+    }
+}
+
+/* Reads the CNT sectors starting at SEC_NO from disk D into
+   BUFFER by PIO, with a single READ SECTOR command that
+   interrupts once per sector as its data becomes ready.  Must be
+   called by D's channel worker. */
+static void
+pio_read (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+          uint8_t *buffer)
 {
-  struct ata_disk *d = d_;
   struct channel *c = d->channel;
-  lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-  output_sector (c, buffer);
-  sema_down (&c->completion_wait);
-  lock_release (&c->lock);
+  size_t i;
+
+  select_sector (d, sec_no, cnt);
+  issue_command (c, CMD_READ_SECTOR_RETRY);
+  for (i = 0; i < cnt; i++)
+    {
+      sema_down (&c->completion_wait);
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no + i);
+      input_sector (c, buffer + i * BLOCK_SECTOR_SIZE);
+    }
 }
 
-static struct block_operations ide_operations =
-  {
-    ide_read,
-    ide_write
-  };
+/* Writes the CNT sectors starting at SEC_NO to disk D from
+   BUFFER by PIO, with a single WRITE SECTOR command that
+   interrupts once per sector as it is accepted.  Must be called
+   by D's channel worker. */
+static void
+pio_write (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+           const uint8_t *buffer)
+{
+  struct channel *c = d->channel;
+  size_t i;
+
+  select_sector (d, sec_no, cnt);
+  issue_command (c, CMD_WRITE_SECTOR_RETRY);
+  for (i = 0; i < cnt; i++)
+    {
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no + i);
+      output_sector (c, buffer + i * BLOCK_SECTOR_SIZE);
+      sema_down (&c->completion_wait);
+    }
+}
+
+/* Bus-master DMA. */
+
+/* Looks for a PCI IDE controller that can act as a bus master
+   for the legacy channels, and enables bus mastering on it.
+   Returns its bus master base port, or 0 if there is none. */
+static uint16_t
+find_bus_master (void)
+{
+  struct pci_address addr;
+  uint32_t prog_if, bar, command;
+
+  if (!pci_find_class (0x01, 0x01, &addr))
+    return 0;
+
+  /* Programming interface bit 7 says the controller is a bus
+     master; bits 0 and 2 say a channel is in native mode, at
+     ports other than the legacy ones we drive. */
+  prog_if = (pci_read_config (addr, PCI_REG_CLASS) >> 8) & 0xff;
+  if (!(prog_if & 0x80) || (prog_if & 0x05))
+    return 0;
+
+  /* BAR 4 holds the bus master ports, in I/O space. */
+  bar = pci_read_config (addr, PCI_REG_BAR (4));
+  if (!(bar & 1) || (bar & 0xfffc) == 0)
+    return 0;
+
+  command = pci_read_config (addr, PCI_REG_COMMAND) & 0xffff;
+  pci_write_config (addr, PCI_REG_COMMAND,
+                    command | PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+
+  return bar & 0xfffc;
+}
+
+/* Fills in the PRD table of channel C to cover the SIZE bytes
+   of BUFFER, which are physically contiguous because kernel
+   virtual memory maps physical memory one-to-one. */
+static void
+setup_prdt (struct channel *c, const void *buffer, size_t size)
+{
+  uintptr_t addr = vtop (buffer);
+  struct prd *prd = c->prdt;
+
+  while (size > 0)
+    {
+      size_t chunk = PRD_BOUNDARY - addr % PRD_BOUNDARY;
+      if (chunk > size)
+        chunk = size;
+
+      ASSERT (prd < c->prdt + PRD_CNT);
+      prd->addr = addr;
+      prd->size = chunk;
+      addr += chunk;
+      size -= chunk;
+      prd->flags = size == 0 ? PRD_EOT : 0;
+      prd++;
+    }
+}
+
+/* Transfers the CNT sectors starting at SEC_NO between disk D and
+   BUFFER by bus-master DMA, reading from the disk unless WRITE is
+   true.  The calling thread sleeps until the transfer completes,
+   so that other threads run meanwhile.  Must be called by D's
+   channel worker.
+
+   Returns false, without transferring anything, if D or BUFFER
+   is not suitable for DMA.  Also returns false if the transfer
+   fails, after turning off DMA for D.  Either way the caller
+   should then use PIO. */
+static bool
+dma_transfer (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+              const void *buffer, bool write)
+{
+  struct channel *c = d->channel;
+  uint8_t direction = write ? 0 : BM_CMD_READ;
+  uint8_t bm_status, status;
+
+  ASSERT (cnt > 0 && cnt <= MAX_SECTORS_PER_COMMAND);
+
+  if (!d->use_dma || !is_kernel_vaddr (buffer) || (uintptr_t) buffer % 2 != 0)
+    return false;
+
+  setup_prdt (c, buffer, cnt * BLOCK_SECTOR_SIZE);
+  barrier ();
+
+  outb (reg_bm_command (c), direction);
+  outl (reg_bm_prdt (c), vtop (c->prdt));
+  outb (reg_bm_status (c),
+        inb (reg_bm_status (c)) | BM_STA_ERR | BM_STA_INTR);
+
+  select_sector (d, sec_no, cnt);
+  issue_command (c, write ? CMD_WRITE_DMA : CMD_READ_DMA);
+  outb (reg_bm_command (c), direction | BM_CMD_START);
+
+  sema_down (&c->completion_wait);
+
+  outb (reg_bm_command (c), direction);
+  bm_status = inb (reg_bm_status (c));
+  outb (reg_bm_status (c), bm_status | BM_STA_ERR | BM_STA_INTR);
+  status = inb (reg_alt_status (c));
+  barrier ();
+
+  if ((bm_status & BM_STA_ERR) || (status & (STA_BSY | STA_DRQ | STA_ERR)))
+    {
+      printf ("%s: DMA %s failed, sector=%"PRDSNu", using PIO\n",
+              d->name, write ? "write" : "read", sec_no);
+      d->use_dma = false;
+      reset_channel (c);
+      return false;
+    }
+
+  return true;
+}
 
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and CNT to the disk's sector selection registers.
+   (We use LBA mode.) */
 static void
-select_sector (struct ata_disk *d, block_sector_t sec_no)
+select_sector (struct ata_disk *d, block_sector_t sec_no, size_t cnt)
 {
   struct channel *c = d->channel;
 
   ASSERT (sec_no < (1UL << 28));
+  ASSERT (cnt > 0 && cnt <= MAX_SECTORS_PER_COMMAND);
+  ASSERT (sec_no + cnt <= (1UL << 28));
   
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), cnt == MAX_SECTORS_PER_COMMAND ? 0 : cnt);
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
@@ -404,7 +735,7 @@ select_sector (struct ata_disk *d, block_sector_t sec_no)
 /* Writes COMMAND to channel C and prepares for receiving a
    completion interrupt. */
 static void
-issue_pio_command (struct channel *c, uint8_t command) 
+issue_command (struct channel *c, uint8_t command) 
 {
   /* Interrupts must be enabled or our semaphore will never be
      up'd by the completion handler. */
@@ -0,0 +1,86 @@
+#include "devices/pci.h"
+#include <debug.h>
+#include "threads/io.h"
+
+/* The code in this file reads and writes PCI configuration space
+   through configuration mechanism #1, the pair of I/O ports found
+   on every PC chipset since the original PCI ones.  See [PCI] for
+   details.  It is just enough to find a device by its class and
+   program it; Pintos does not otherwise enumerate PCI. */
+
+/* Configuration mechanism #1 ports. */
+#define PCI_CONFIG_ADDRESS 0xcf8        /* Selects a register. */
+#define PCI_CONFIG_DATA 0xcfc           /* Reads or writes it. */
+
+/* Selects register REG of the function at ADDR. */
+static void
+select_register (struct pci_address addr, uint8_t reg)
+{
+  ASSERT (addr.dev < 32 && addr.func < 8);
+  ASSERT (reg % 4 == 0);
+
+  outl (PCI_CONFIG_ADDRESS, (0x80000000 | (addr.bus << 16) | (addr.dev << 11)
+                             | (addr.func << 8) | reg));
+}
+
+/* Reads and returns 32-bit configuration register REG of the
+   function at ADDR. */
+uint32_t
+pci_read_config (struct pci_address addr, uint8_t reg)
+{
+  select_register (addr, reg);
+  return inl (PCI_CONFIG_DATA);
+}
+
+/* Writes VALUE to 32-bit configuration register REG of the
+   function at ADDR. */
+void
+pci_write_config (struct pci_address addr, uint8_t reg, uint32_t value)
+{
+  select_register (addr, reg);
+  outl (PCI_CONFIG_DATA, value);
+}
+
+/* Looks for a function with the given CLASS and SUBCLASS codes.
+   If one is found, stores its location in *ADDR and returns
+   true; otherwise returns false. */
+bool
+pci_find_class (uint8_t class, uint8_t subclass, struct pci_address *addr)
+{
+  struct pci_address a;
+  unsigned bus, dev, func;
+
+  for (bus = 0; bus < 256; bus++)
+    for (dev = 0; dev < 32; dev++)
+      for (func = 0; func < 8; func++)
+        {
+          uint32_t class_reg;
+
+          a.bus = bus;
+          a.dev = dev;
+          a.func = func;
+          if ((pci_read_config (a, PCI_REG_ID) & 0xffff) == 0xffff)
+            {
+              /* No such function.  Without function 0 there is no
+                 device at all. */
+              if (func == 0)
+                break;
+              continue;
+            }
+
+          class_reg = pci_read_config (a, PCI_REG_CLASS);
+          if ((class_reg >> 24) == class
+              && ((class_reg >> 16) & 0xff) == subclass)
+            {
+              *addr = a;
+              return true;
+            }
+
+          /* Only multi-function devices have functions 1...7. */
+          if (func == 0
+              && !(pci_read_config (a, PCI_REG_HEADER) & (0x80 << 16)))
+            break;
+        }
+
+  return false;
+}
@@ -0,0 +1,200 @@
+#include "devices/ramdisk.h"
+#include <ctype.h>
+#include <debug.h>
+#include <round.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices/block.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* A RAM disk keeps its sectors in kernel pages, which are
+   allocated the first time part of them is written.  Sectors
+   that have never been written read as zeros.
+
+   RAM disks are meant for measuring the file system and virtual
+   memory code without the cost of emulated disk I/O, so they
+   complete every transfer synchronously in the caller's thread. */
+
+/* Number of sectors in a page. */
+#define SECTORS_PER_PAGE (PGSIZE / BLOCK_SECTOR_SIZE)
+
+/* A RAM disk. */
+struct ramdisk
+  {
+    block_sector_t size;        /* Size in sectors. */
+    uint8_t **pages;            /* Backing pages, null until written. */
+    struct lock lock;           /* Serializes allocating pages. */
+  };
+
+/* Size in sectors of the RAM disk to create for each role, or 0
+   if the role gets none. */
+static block_sector_t ramdisk_size[BLOCK_ROLE_CNT];
+
+static struct block_operations ramdisk_operations;
+
+/* Configures a RAM disk from SPEC, the value of a -ramdisk
+   option, which takes the form ROLE:SIZE.  ROLE is "filesys",
+   "scratch", or "swap".  SIZE is in bytes and may carry a "K"
+   or "M" suffix; it is rounded up to a whole sector.  The disk
+   is created by ramdisk_init(). */
+void
+ramdisk_configure (const char *spec)
+{
+  const char *colon = spec != NULL ? strchr (spec, ':') : NULL;
+  enum block_type role;
+  unsigned long long bytes = 0;
+  const char *p;
+
+  if (colon == NULL)
+    PANIC ("-ramdisk requires ROLE:SIZE");
+
+  for (role = BLOCK_FILESYS; role < BLOCK_ROLE_CNT; role++)
+    {
+      const char *name = block_type_name (role);
+      if (strlen (name) == (size_t) (colon - spec)
+          && !memcmp (name, spec, colon - spec))
+        break;
+    }
+  if (role >= BLOCK_ROLE_CNT)
+    PANIC ("-ramdisk: unknown role in `%s'", spec);
+
+  for (p = colon + 1; isdigit (*p); p++)
+    bytes = bytes * 10 + (*p - '0');
+  if (*p == 'K' || *p == 'k')
+    bytes *= 1024, p++;
+  else if (*p == 'M' || *p == 'm')
+    bytes *= 1024 * 1024, p++;
+  if (p == colon + 1 || *p != '\0' || bytes == 0
+      || DIV_ROUND_UP (bytes, BLOCK_SECTOR_SIZE) > UINT32_MAX)
+    PANIC ("-ramdisk: bad size in `%s'", spec);
+
+  ramdisk_size[role] = DIV_ROUND_UP (bytes, BLOCK_SECTOR_SIZE);
+}
+
+/* Creates the RAM disks requested by ramdisk_configure() and
+   assigns each its role. */
+void
+ramdisk_init (void)
+{
+  enum block_type role;
+  int disk_no = 0;
+
+  for (role = BLOCK_FILESYS; role < BLOCK_ROLE_CNT; role++)
+    if (ramdisk_size[role] != 0)
+      {
+        struct ramdisk *d = malloc (sizeof *d);
+        size_t page_cnt = DIV_ROUND_UP (ramdisk_size[role], SECTORS_PER_PAGE);
+        char name[16];
+
+        if (d != NULL)
+          d->pages = calloc (page_cnt, sizeof *d->pages);
+        if (d == NULL || d->pages == NULL)
+          PANIC ("can't allocate RAM disk for %s", block_type_name (role));
+        d->size = ramdisk_size[role];
+        lock_init (&d->lock);
+
+        snprintf (name, sizeof name, "ram%d", disk_no++);
+        block_set_role (role, block_register (name, BLOCK_RAW, "RAM disk",
+                                              d->size, &ramdisk_operations,
+                                              d));
+      }
+}
+
+/* Returns the page of RAM disk D that holds SEC_NO, allocating
+   it first if ALLOCATE is true and it has never been written.
+   Returns a null pointer if it has not been allocated. */
+static uint8_t *
+get_page (struct ramdisk *d, block_sector_t sec_no, bool allocate)
+{
+  uint8_t **page = &d->pages[sec_no / SECTORS_PER_PAGE];
+
+  if (*page == NULL && allocate)
+    {
+      lock_acquire (&d->lock);
+      if (*page == NULL)
+        {
+          *page = palloc_get_page (PAL_ZERO);
+          if (*page == NULL)
+            PANIC ("RAM disk out of memory");
+        }
+      lock_release (&d->lock);
+    }
+  return *page;
+}
+
+/* Reads the CNT sectors starting at SEC_NO from RAM disk D into
+   BUFFER. */
+static void
+ramdisk_read_multiple (void *d_, block_sector_t sec_no, size_t cnt,
+                       void *buffer)
+{
+  struct ramdisk *d = d_;
+  uint8_t *dst = buffer;
+
+  while (cnt > 0)
+    {
+      uint8_t *page = get_page (d, sec_no, false);
+      size_t ofs = sec_no % SECTORS_PER_PAGE;
+      size_t run = SECTORS_PER_PAGE - ofs < cnt ? SECTORS_PER_PAGE - ofs : cnt;
+      size_t bytes = run * BLOCK_SECTOR_SIZE;
+
+      if (page != NULL)
+        memcpy (dst, page + ofs * BLOCK_SECTOR_SIZE, bytes);
+      else
+        memset (dst, 0, bytes);
+
+      dst += bytes;
+      sec_no += run;
+      cnt -= run;
+    }
+}
+
+/* Writes the CNT sectors starting at SEC_NO on RAM disk D from
+   BUFFER. */
+static void
+ramdisk_write_multiple (void *d_, block_sector_t sec_no, size_t cnt,
+                        const void *buffer)
+{
+  struct ramdisk *d = d_;
+  const uint8_t *src = buffer;
+
+  while (cnt > 0)
+    {
+      uint8_t *page = get_page (d, sec_no, true);
+      size_t ofs = sec_no % SECTORS_PER_PAGE;
+      size_t run = SECTORS_PER_PAGE - ofs < cnt ? SECTORS_PER_PAGE - ofs : cnt;
+      size_t bytes = run * BLOCK_SECTOR_SIZE;
+
+      memcpy (page + ofs * BLOCK_SECTOR_SIZE, src, bytes);
+
+      src += bytes;
+      sec_no += run;
+      cnt -= run;
+    }
+}
+
+/* Reads sector SEC_NO from RAM disk D into BUFFER. */
+static void
+ramdisk_read (void *d, block_sector_t sec_no, void *buffer)
+{
+  ramdisk_read_multiple (d, sec_no, 1, buffer);
+}
+
+/* Writes sector SEC_NO on RAM disk D from BUFFER. */
+static void
+ramdisk_write (void *d, block_sector_t sec_no, const void *buffer)
+{
+  ramdisk_write_multiple (d, sec_no, 1, buffer);
+}
+
+static struct block_operations ramdisk_operations =
+  {
+    ramdisk_read,
+    ramdisk_write,
+    ramdisk_read_multiple,
+    ramdisk_write_multiple,
+    NULL
+  };
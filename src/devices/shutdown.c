@@ -12,6 +12,8 @@
 #ifdef FILESYS
 #include "devices/block.h"
 #include "filesys/filesys.h"
+#include "filesys/cache.h"
+#include "filesys/fsutil.h"
 #endif
 
 /* Keyboard control register port. */
@@ -92,6 +94,7 @@ shutdown_power_off (void)
 
 #ifdef FILESYS
   filesys_done ();
+  fsutil_append_block_trace ();
 #endif
 
   print_stats ();
@@ -124,6 +127,7 @@ print_stats (void)
   thread_print_stats ();
 #ifdef FILESYS
   block_print_stats ();
+  cache_print_stats ();
 #endif
   console_print_stats ();
   kbd_print_stats ();
@@ -1,153 +1,562 @@
 #include "filesys/cache.h"
-#include <bitmap.h>
+#include <hash.h>
+#include <round.h>
 #include <string.h>
 #include <stdio.h>
 #include "devices/timer.h"
 #include "threads/synch.h"
 #include "threads/thread.h"
 #include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
 #include "filesys/filesys.h"
 
-#define CACHE_MAX 64
+#define CACHE_DEFAULT_SIZE 64   /* Default number of slots. */
+#define CACHE_MIN_SIZE 16       /* Fewest slots the cache works well with. */
+#define READ_AHEAD_MAX 32       /* Capacity of the read-ahead queue. */
+#define READ_AHEAD_INFLIGHT_MAX 4 /* Most read-ahead transfers at once. */
+
+/* Most adjacent sectors moved by one clustered transfer, staged
+   through a single page. */
+#define CLUSTER_MAX (PGSIZE / BLOCK_SECTOR_SIZE)
+
+/* Write-behind tuning.  The write_behind_async daemon wakes up
+   every WRITE_BEHIND_PERIOD_MS and writes dirty slots back in
+   batches of WRITE_BEHIND_BATCH, lowest sector first, while a
+   slot has been dirty for DIRTY_EXPIRE_TICKS or more than
+   DIRTY_HIGH_WATER slots are dirty.  Writers that find
+   DIRTY_HARD_LIMIT slots dirty write a batch back themselves
+   before going on. */
+#define WRITE_BEHIND_PERIOD_MS 500
+#define WRITE_BEHIND_BATCH 8
+#define DIRTY_EXPIRE_TICKS (3 * TIMER_FREQ)
+#define DIRTY_HIGH_WATER (cache_size / 4)
+#define DIRTY_HARD_LIMIT (cache_size / 2)
 
 static void read_ahead_async (void *aux UNUSED);
-static void flush_all_async (void *aux UNUSED);
+static void write_behind_async (void *aux UNUSED);
+
+/* State of a cache slot. */
+enum cache_state
+  {
+    CACHE_FREE,                 /* Holds no sector. */
+    CACHE_LOADING,              /* Being filled; its rwlock is held for writing. */
+    CACHE_VALID,                /* Holds SECTOR's data. */
+    CACHE_EVICTING              /* Being written back before eviction. */
+  };
+
+/* A buffer cache slot.
+
+   The global cache lock protects cache_map and every member but
+   DATA.  DATA is protected by RWLOCK, which is only acquired
+   while the slot is pinned, and never while holding the global
+   lock for longer than it takes to grab an uncontended rwlock.
+   Disk I/O is done holding only RWLOCK, so that lookups and hits
+   on other slots proceed while a miss or a write-back is in
+   flight, and readers of the same slot share it. */
+struct cache_entry
+  {
+    block_sector_t sector;              /* Cached sector number. */
+    struct hash_elem hash_elem;         /* Element in cache_map. */
+    enum cache_state state;             /* Slot state. */
+    bool dirty;                         /* Modified since last write-back? */
+    int64_t dirty_since;                /* Tick at which DIRTY was set. */
+    bool accessed;                      /* Reference bit for pop_victim. */
+    bool prefetched;                    /* Read ahead and not used since? */
+    bool writing;                       /* Write-back in flight?  Pinned if so. */
+    int pin_cnt;                        /* Users; a pinned slot is never evicted. */
+    struct rwlock rwlock;               /* Protects DATA. */
+    uint8_t *data;                      /* BLOCK_SECTOR_SIZE bytes. */
+  };
 
-static char cache_entries[CACHE_MAX * BLOCK_SECTOR_SIZE];
-static block_sector_t cache_sectors[CACHE_MAX];
+/* Number of slots, set with -cache=N on the kernel command line. */
+static size_t cache_size = CACHE_DEFAULT_SIZE;
+
+static char *cache_entries;             /* Slot data, from palloc. */
+static struct cache_entry *cache_slots; /* Array of cache_size slots. */
+
+/* Sector -> slot of every slot holding a sector, so that a lookup
+   does not have to scan every slot. */
+static struct hash cache_map;
 
 static struct lock lock;
-static struct bitmap *used_map;
-static struct bitmap *dirty_map;
+static struct condition slot_unpinned;  /* Signaled when a pin_cnt drops to 0. */
+static struct condition write_done;     /* Broadcast when write-backs finish. */
+static size_t dirty_cnt;                /* Number of dirty slots. */
+static struct cache_stats stats;        /* Counters, protected by LOCK. */
 
-static size_t pop_victim (void);
-static size_t find_cache_idx (block_sector_t sector);
+static struct cache_entry *cache_acquire (block_sector_t sector, bool exclusive,
+                                          bool load);
+static void cache_release (struct cache_entry *entry, bool exclusive, bool dirty);
+static struct cache_entry *load_entry (struct cache_entry *entry,
+                                       block_sector_t sector, bool exclusive,
+                                       bool load);
+static void bind_entry (struct cache_entry *entry, block_sector_t sector);
+static void unpin_entry (struct cache_entry *entry);
+static struct cache_entry *pop_victim (bool wait);
+static struct prefetch *prefetch (block_sector_t sector, size_t cnt);
+static void finish_prefetch (struct prefetch *);
+static void prefetch_done (struct block_request *);
+static void write_back_done (struct block_request *);
+static void write_back (struct cache_entry *entry, bool async);
+static size_t write_behind (bool expired_only, bool async);
+static void throttle_writers (void);
+static struct cache_entry *find_cache_entry (block_sector_t sector);
+static void cache_lock_acquire (void);
+
+static unsigned cache_hash_func (const struct hash_elem *a, void *aux);
+static bool cache_less_func (const struct hash_elem *a, const struct hash_elem *b, void *aux);
 
-static block_sector_t read_ahead_sector;
 static size_t victim_idx;
 
+/* Read-ahead requests: a ring of sectors served, oldest first, by
+   the read_ahead_async thread. */
+static block_sector_t read_ahead_queue[READ_AHEAD_MAX];
+static size_t read_ahead_head;          /* Index of the oldest request. */
+static size_t read_ahead_cnt;           /* Number of queued requests. */
+static struct list read_ahead_done;     /* Finished prefetch transfers. */
+static struct lock read_ahead_lock;     /* Protects the queue and list. */
+static struct condition read_ahead_cond; /* Signaled when either grows. */
+
+/* A read-ahead transfer, submitted by the read_ahead_async
+   thread and handed back to it by prefetch_done() to copy the
+   data into the slots it holds locked. */
+struct prefetch
+  {
+    struct block_request req;           /* The transfer. */
+    struct list_elem elem;              /* Element in read_ahead_done. */
+    struct cache_entry *run[CLUSTER_MAX]; /* Slots being filled. */
+  };
+
+/* A write-back submitted without waiting for it, finished by
+   write_back_done(). */
+struct write_back_request
+  {
+    struct block_request req;           /* The transfer. */
+    struct cache_entry *run[CLUSTER_MAX]; /* Slots being written. */
+  };
+
+/* Sets the number of sectors the cache holds to SIZE.  Must be
+   called before cache_init(). */
+void
+cache_configure (size_t size)
+{
+  if (size < CACHE_MIN_SIZE)
+    PANIC ("buffer cache must hold at least %d sectors", CACHE_MIN_SIZE);
+
+  cache_size = size;
+}
+
 void
 cache_init (void)
 {
-  used_map = bitmap_create (CACHE_MAX);
-  dirty_map = bitmap_create (CACHE_MAX);
+  size_t page_cnt = DIV_ROUND_UP (cache_size * BLOCK_SECTOR_SIZE, PGSIZE);
+  size_t i;
+
+  cache_entries = palloc_get_multiple (0, page_cnt);
+  cache_slots = malloc (cache_size * sizeof *cache_slots);
+  if (cache_entries == NULL || cache_slots == NULL)
+    PANIC ("can't allocate %zu-sector buffer cache", cache_size);
+
+  for (i = 0; i < cache_size; i++)
+    {
+      struct cache_entry *entry = &cache_slots[i];
+
+      entry->state = CACHE_FREE;
+      entry->dirty = false;
+      entry->accessed = false;
+      entry->prefetched = false;
+      entry->writing = false;
+      entry->pin_cnt = 0;
+      rwlock_init (&entry->rwlock);
+      entry->data = (uint8_t *) &cache_entries[i * BLOCK_SECTOR_SIZE];
+    }
+
+  hash_init (&cache_map, cache_hash_func, cache_less_func, NULL);
 
   victim_idx = 0;
 
   lock_init (&lock);
+  cond_init (&slot_unpinned);
+  cond_init (&write_done);
+  dirty_cnt = 0;
+
+  read_ahead_head = 0;
+  read_ahead_cnt = 0;
+  list_init (&read_ahead_done);
+  lock_init (&read_ahead_lock);
+  cond_init (&read_ahead_cond);
 
   thread_create ("read_ahead_async", PRI_DEFAULT, read_ahead_async, NULL);
-  thread_create ("flush_all_async", PRI_DEFAULT, flush_all_async, NULL);
+  thread_create ("write_behind_async", PRI_DEFAULT, write_behind_async, NULL);
 }
 
-static size_t
-find_and_cache_read (block_sector_t sector)
+void
+cache_read (struct block *block, block_sector_t sector, void *buffer)
 {
-  size_t cache_idx = find_cache_idx (sector);
-  if (cache_idx == CACHE_MAX)
-    {
-      cache_idx = bitmap_scan_and_flip (used_map, 0, 1, false);
+  cache_read_at (block, sector, buffer, 0, BLOCK_SECTOR_SIZE);
+}
 
-      if (cache_idx == BITMAP_ERROR)
-        cache_idx = pop_victim ();
-      else
-        ASSERT (!bitmap_test (dirty_map, cache_idx));
+void
+cache_write (struct block *block, block_sector_t sector, const void *buffer)
+{
+  cache_write_at (block, sector, buffer, 0, BLOCK_SECTOR_SIZE);
+}
 
-      block_read (fs_device, sector, &cache_entries[cache_idx * BLOCK_SECTOR_SIZE]);
-      cache_sectors[cache_idx] = sector;
-    }
+/* Copies SIZE bytes starting at byte OFS of SECTOR into BUFFER,
+   straight out of the cache slot. */
+void
+cache_read_at (struct block *block, block_sector_t sector, void *buffer,
+               size_t ofs, size_t size)
+{
+  ASSERT (block == fs_device);
+  ASSERT (ofs + size <= BLOCK_SECTOR_SIZE);
+
+  struct cache_entry *entry = cache_acquire (sector, false, true);
+
+  memcpy (buffer, entry->data + ofs, size);
 
-  return cache_idx;
+  cache_release (entry, false, false);
 }
 
+/* Copies SIZE bytes from BUFFER into SECTOR starting at byte OFS,
+   straight into the cache slot.  The rest of the sector is read
+   from disk first only if the write does not cover all of it. */
 void
-cache_read (struct block *block, block_sector_t sector, void *buffer)
+cache_write_at (struct block *block, block_sector_t sector, const void *buffer,
+                size_t ofs, size_t size)
 {
-  // block_read (block, sector, buffer);
   ASSERT (block == fs_device);
+  ASSERT (block != NULL);
+  ASSERT (ofs + size <= BLOCK_SECTOR_SIZE);
 
-  lock_acquire (&lock);
+  bool partial = ofs > 0 || size < BLOCK_SECTOR_SIZE;
+  struct cache_entry *entry = cache_acquire (sector, true, partial);
 
-  size_t cache_idx = find_and_cache_read (sector);
+  memcpy (entry->data + ofs, buffer, size);
 
-  ASSERT (cache_idx < CACHE_MAX);
+  cache_release (entry, true, true);
 
-  memcpy (buffer, &cache_entries[cache_idx * BLOCK_SECTOR_SIZE], BLOCK_SECTOR_SIZE);
+  throttle_writers ();
+}
 
-  lock_release (&lock);
+/* Returns SECTOR's data in place in the cache, pinned so that it
+   is not evicted until it is passed to cache_put().  If EXCLUSIVE
+   is true, the slot is locked for writing and the caller may
+   modify the data; otherwise it is locked for reading, shared
+   with other readers, and must not be modified.  The caller must
+   not get the same sector twice, and should not block on
+   anything but other cache slots while holding one. */
+void *
+cache_get (struct block *block, block_sector_t sector, bool exclusive)
+{
+  ASSERT (block == fs_device);
 
-  read_ahead_sector = sector + 1;
+  return cache_acquire (sector, exclusive, true)->data;
 }
 
-void
-cache_write (struct block *block, block_sector_t sector, const void *buffer)
+/* Like cache_get() with EXCLUSIVE set, for a sector whose old
+   contents do not matter: the data is zero-filled instead of read
+   from disk. */
+void *
+cache_get_new (struct block *block, block_sector_t sector)
 {
-  // block_write (block, sector, buffer);
   ASSERT (block == fs_device);
-  ASSERT (block != NULL);
 
-  lock_acquire (&lock);
+  struct cache_entry *entry = cache_acquire (sector, true, false);
 
-  size_t cache_idx = find_cache_idx (sector);
-  if (cache_idx == CACHE_MAX)
-    {
-      cache_idx = bitmap_scan_and_flip (used_map, 0, 1, false);
+  memset (entry->data, 0, BLOCK_SECTOR_SIZE);
 
-      if (cache_idx == BITMAP_ERROR)
-        cache_idx = pop_victim ();
+  return entry->data;
+}
+
+/* Releases DATA, returned by cache_get() or cache_get_new().  If
+   DIRTY is true the sector is marked as modified. */
+void
+cache_put (const void *data, bool dirty)
+{
+  size_t ofs = (const char *) data - cache_entries;
+  struct cache_entry *entry = &cache_slots[ofs / BLOCK_SECTOR_SIZE];
+
+  ASSERT (ofs % BLOCK_SECTOR_SIZE == 0 && ofs / BLOCK_SECTOR_SIZE < cache_size);
+
+  cache_release (entry, rwlock_held_by_current_thread (&entry->rwlock), dirty);
+
+  if (dirty)
+    throttle_writers ();
+}
 
-      cache_sectors[cache_idx] = sector;
+/* Queues SECTOR to be read into the cache in the background.
+   The request is dropped if the queue is full or already holds
+   SECTOR. */
+void
+cache_read_ahead (block_sector_t sector)
+{
+  size_t i;
+
+  lock_acquire (&read_ahead_lock);
+
+  for (i = 0; i < read_ahead_cnt; i++)
+    if (read_ahead_queue[(read_ahead_head + i) % READ_AHEAD_MAX] == sector)
+      break;
 
-      ASSERT (!bitmap_test (dirty_map, cache_idx));
+  if (i == read_ahead_cnt && read_ahead_cnt < READ_AHEAD_MAX)
+    {
+      read_ahead_queue[(read_ahead_head + read_ahead_cnt) % READ_AHEAD_MAX] = sector;
+      read_ahead_cnt++;
+      cond_signal (&read_ahead_cond, &read_ahead_lock);
     }
 
-  ASSERT (cache_idx < CACHE_MAX);
+  lock_release (&read_ahead_lock);
+}
+
+void
+cache_flush (block_sector_t sector)
+{
+  cache_lock_acquire ();
+
+  struct cache_entry *entry = find_cache_entry (sector);
 
-  bitmap_mark (dirty_map, cache_idx);
-  memcpy (&cache_entries[cache_idx * BLOCK_SECTOR_SIZE], buffer, BLOCK_SECTOR_SIZE);
+  if (entry != NULL)
+    write_back (entry, false);
 
   lock_release (&lock);
 }
 
+/* Drops the CNT sectors starting at SECTOR from the cache without
+   writing them back, because they are being freed.  Waits for a
+   slot that is in use or being written first, so that no stale
+   write reaches a sector once it has been reallocated. */
 void
-cache_flush (block_sector_t sector)
+cache_discard (block_sector_t sector, size_t cnt)
 {
-  size_t cache_idx = find_cache_idx (sector);
+  size_t i;
 
-  if (cache_idx < CACHE_MAX)
+  cache_lock_acquire ();
+  for (i = 0; i < cnt; i++)
     {
-      victim_idx = cache_idx;
-      pop_victim ();
+      struct cache_entry *entry;
+
+      while ((entry = find_cache_entry (sector + i)) != NULL)
+        if (entry->writing)
+          cond_wait (&write_done, &lock);
+        else if (entry->pin_cnt > 0 || entry->state != CACHE_VALID)
+          cond_wait (&slot_unpinned, &lock);
+        else
+          {
+            if (entry->dirty)
+              {
+                entry->dirty = false;
+                dirty_cnt--;
+              }
+            hash_delete (&cache_map, &entry->hash_elem);
+            entry->state = CACHE_FREE;
+            break;
+          }
     }
+  lock_release (&lock);
 }
 
 void
 cache_flush_all ()
 {
-  lock_acquire (&lock);
+  cache_lock_acquire ();
 
-  read_ahead_sector = CACHE_MAX;
+  size_t i;
 
-  int i;
+  for (i = 0; i < cache_size; i++)
+    if (cache_slots[i].state == CACHE_VALID)
+      write_back (&cache_slots[i], false);
 
-  for (i = 0; i < CACHE_MAX; i++)
-    pop_victim ();
+  lock_release (&lock);
+}
 
+/* Copies the cache counters into *OUT. */
+void
+cache_get_stats (struct cache_stats *out)
+{
+  struct cache_stats copy;
+
+  cache_lock_acquire ();
+  copy = stats;
   lock_release (&lock);
+
+  *out = copy;
 }
 
-static size_t
-find_cache_idx (block_sector_t sector)
+/* Prints buffer cache statistics. */
+void
+cache_print_stats (void)
 {
-  size_t cache_idx;
+  struct cache_stats s;
+
+  cache_get_stats (&s);
+  printf ("Cache: %llu hits, %llu misses, %llu evictions, "
+          "%llu writebacks\n",
+          s.hits, s.misses, s.evictions, s.writebacks);
+  printf ("Cache: %llu read ahead, %llu used, %llu wasted\n",
+          s.read_aheads, s.read_ahead_hits, s.read_ahead_wasted);
+  printf ("Cache: %llu lock waits, %llu cycles waiting\n",
+          s.lock_waits, s.lock_wait_cycles);
+}
 
-  for (cache_idx = 0; cache_idx < CACHE_MAX; cache_idx++)
+/* Pins the slot holding SECTOR, creating it if SECTOR is not
+   cached, and acquires its rwlock for writing if EXCLUSIVE,
+   otherwise for reading.  A newly created slot is filled from
+   disk if LOAD is true; otherwise the caller must overwrite the
+   whole sector.  Release the slot with cache_release(). */
+static struct cache_entry *
+cache_acquire (block_sector_t sector, bool exclusive, bool load)
+{
+  struct cache_entry *entry;
+
+  cache_lock_acquire ();
+
+  entry = find_cache_entry (sector);
+  if (entry == NULL)
     {
-      if (bitmap_test (used_map, cache_idx) && cache_sectors[cache_idx] == sector)
-        break;
+      struct cache_entry *victim = pop_victim (true);
+
+      /* pop_victim() may have released the lock, letting another
+         thread bring SECTOR in; if so, VICTIM stays free. */
+      entry = find_cache_entry (sector);
+      if (entry == NULL)
+        {
+          stats.misses++;
+          return load_entry (victim, sector, exclusive, load);
+        }
+    }
+
+  stats.hits++;
+  if (entry->prefetched)
+    {
+      entry->prefetched = false;
+      stats.read_ahead_hits++;
+    }
+
+  /* Hit.  If the slot is still loading, the loader holds its
+     rwlock, so we wait below until the data is valid. */
+  entry->pin_cnt++;
+  entry->accessed = true;
+  lock_release (&lock);
+
+  if (exclusive)
+    rwlock_write_acquire (&entry->rwlock);
+  else
+    rwlock_read_acquire (&entry->rwlock);
+
+  return entry;
+}
+
+/* Binds free slot ENTRY to SECTOR and pins it, and fills it from
+   disk if LOAD is true, holding its rwlock for writing with the
+   global lock released.  The global lock must be held on entry,
+   and is released on return.  Returns ENTRY locked as
+   cache_acquire() would. */
+static struct cache_entry *
+load_entry (struct cache_entry *entry, block_sector_t sector, bool exclusive,
+            bool load)
+{
+  bind_entry (entry, sector);
+  lock_release (&lock);
+
+  if (load)
+    block_transfer (fs_device, sector, 1, entry->data, false,
+                    BLOCK_TAG_CACHE);
+
+  entry->state = CACHE_VALID;
+
+  if (!exclusive)
+    {
+      rwlock_write_release (&entry->rwlock);
+      rwlock_read_acquire (&entry->rwlock);
     }
 
-  return cache_idx;
+  return entry;
+}
+
+/* Binds free slot ENTRY to SECTOR, pins it and locks it for
+   writing in the CACHE_LOADING state.  The global lock must be
+   held. */
+static void
+bind_entry (struct cache_entry *entry, block_sector_t sector)
+{
+  ASSERT (lock_held_by_current_thread (&lock));
+  ASSERT (entry->state == CACHE_FREE);
+
+  entry->sector = sector;
+  entry->state = CACHE_LOADING;
+  entry->prefetched = false;
+  entry->pin_cnt = 1;
+  hash_insert (&cache_map, &entry->hash_elem);
+  rwlock_write_acquire (&entry->rwlock);
+}
+
+/* Releases ENTRY, acquired with cache_acquire() in the given
+   EXCLUSIVE mode, marking it dirty if DIRTY is true. */
+static void
+cache_release (struct cache_entry *entry, bool exclusive, bool dirty)
+{
+  if (exclusive)
+    rwlock_write_release (&entry->rwlock);
+  else
+    rwlock_read_release (&entry->rwlock);
+
+  cache_lock_acquire ();
+
+  if (dirty && !entry->dirty)
+    {
+      entry->dirty = true;
+      entry->dirty_since = timer_ticks ();
+      dirty_cnt++;
+    }
+
+  unpin_entry (entry);
+
+  lock_release (&lock);
+}
+
+/* Drops a pin on ENTRY.  The global lock must be held. */
+static void
+unpin_entry (struct cache_entry *entry)
+{
+  ASSERT (lock_held_by_current_thread (&lock));
+  ASSERT (entry->pin_cnt > 0);
+
+  if (--entry->pin_cnt == 0)
+    cond_broadcast (&slot_unpinned, &lock);
+}
+
+/* Acquires the global cache lock, counting the time spent
+   waiting for it if another thread holds it. */
+static void
+cache_lock_acquire (void)
+{
+  uint64_t start;
+
+  if (lock_try_acquire (&lock))
+    return;
+
+  start = timer_cycles ();
+  lock_acquire (&lock);
+  stats.lock_waits++;
+  stats.lock_wait_cycles += timer_cycles () - start;
+}
+
+/* Returns the slot caching SECTOR, or a null pointer if SECTOR is
+   not cached.  The global lock must be held. */
+static struct cache_entry *
+find_cache_entry (block_sector_t sector)
+{
+  struct cache_entry key;
+  struct hash_elem *e;
+
+  ASSERT (lock_held_by_current_thread (&lock));
+
+  key.sector = sector;
+  e = hash_find (&cache_map, &key.hash_elem);
+
+  return e != NULL ? hash_entry (e, struct cache_entry, hash_elem) : NULL;
 }
 
 static void
@@ -155,57 +564,494 @@ incr_victim_idx (void)
 {
   victim_idx++;
 
-  if (victim_idx >= CACHE_MAX)
+  if (victim_idx >= cache_size)
     victim_idx = 0;
 }
 
-static size_t
-pop_victim ()
+/* Returns true if ENTRY may join a clustered write-back: it is
+   a valid, dirty slot nobody is using. */
+static bool
+clusterable (const struct cache_entry *entry)
+{
+  return (entry != NULL && entry->state == CACHE_VALID && entry->dirty
+          && entry->pin_cnt == 0);
+}
+
+/* Writes ENTRY to disk if it is dirty, together with the dirty,
+   unused slots caching the sectors adjacent to it, up to
+   CLUSTER_MAX sectors in one transfer.  The global lock must be
+   held; it is released while copying and writing.
+
+   If ASYNC is false, returns once the write is done.  A lone
+   sector is then written holding its rwlock for reading, so that
+   writers wait for it while readers do not.  A cluster, or any
+   asynchronous write, is first copied, one slot at a time, into
+   a staging buffer, so that no thread ever waits for one slot
+   while holding another.
+
+   If ASYNC is true, submits the write and returns without
+   waiting for it; the slots stay pinned until write_back_done().
+   Then ENTRY is skipped if a write of it is already in flight,
+   whereas a synchronous write waits for that one first, so that
+   the writes of a sector reach the disk in order. */
+static void
+write_back (struct cache_entry *entry, bool async)
+{
+  struct cache_entry *run[CLUSTER_MAX];
+  struct write_back_request *wb = NULL;
+  block_sector_t first, sector;
+  uint8_t *buffer = NULL;
+  size_t cnt, i;
+
+  ASSERT (lock_held_by_current_thread (&lock));
+
+  while (entry->writing)
+    {
+      if (async)
+        return;
+      cond_wait (&write_done, &lock);
+    }
+
+  if (!entry->dirty)
+    return;
+
+  /* Gather the run of dirty sectors around ENTRY. */
+  for (first = entry->sector;
+       first > 0 && entry->sector - first + 1 < CLUSTER_MAX
+         && clusterable (find_cache_entry (first - 1));
+       first--)
+    continue;
+
+  for (cnt = 0, sector = first; cnt < CLUSTER_MAX; cnt++, sector++)
+    {
+      struct cache_entry *e = (sector == entry->sector
+                               ? entry : find_cache_entry (sector));
+      if (e != entry && !clusterable (e))
+        break;
+
+      e->dirty = false;
+      dirty_cnt--;
+      e->pin_cnt++;
+      e->writing = true;
+      run[cnt] = e;
+    }
+  stats.writebacks += cnt;
+
+  lock_release (&lock);
+
+  if (async)
+    {
+      wb = malloc (sizeof *wb);
+      buffer = malloc (cnt * BLOCK_SECTOR_SIZE);
+      if (wb == NULL || buffer == NULL)
+        {
+          free (wb);
+          free (buffer);
+          wb = NULL;
+          buffer = NULL;
+        }
+    }
+  else if (cnt > 1)
+    buffer = palloc_get_page (0);
+
+  if (buffer != NULL)
+    {
+      for (i = 0; i < cnt; i++)
+        {
+          rwlock_read_acquire (&run[i]->rwlock);
+          memcpy (buffer + i * BLOCK_SECTOR_SIZE, run[i]->data, BLOCK_SECTOR_SIZE);
+          rwlock_read_release (&run[i]->rwlock);
+        }
+
+      if (wb != NULL)
+        {
+          memcpy (wb->run, run, cnt * sizeof *run);
+          wb->req.sector = first;
+          wb->req.cnt = cnt;
+          wb->req.buffer = buffer;
+          wb->req.write = true;
+          wb->req.complete = write_back_done;
+          wb->req.aux = wb;
+          wb->req.tag = BLOCK_TAG_WRITE_BACK;
+          block_submit (fs_device, &wb->req);
+
+          cache_lock_acquire ();
+          return;
+        }
+
+      block_transfer (fs_device, first, cnt, buffer, true,
+                      BLOCK_TAG_WRITE_BACK);
+      palloc_free_page (buffer);
+    }
+  else
+    {
+      for (i = 0; i < cnt; i++)
+        {
+          rwlock_read_acquire (&run[i]->rwlock);
+          block_transfer (fs_device, run[i]->sector, 1, run[i]->data, true,
+                          BLOCK_TAG_WRITE_BACK);
+          rwlock_read_release (&run[i]->rwlock);
+        }
+    }
+
+  cache_lock_acquire ();
+  for (i = 0; i < cnt; i++)
+    {
+      run[i]->writing = false;
+      unpin_entry (run[i]);
+    }
+  cond_broadcast (&write_done, &lock);
+}
+
+/* Completion function for asynchronous write-backs. */
+static void
+write_back_done (struct block_request *req)
 {
-  bool is_dirty = bitmap_test (dirty_map, victim_idx);
-  if (is_dirty)
+  struct write_back_request *wb = req->aux;
+  size_t i;
+
+  cache_lock_acquire ();
+  for (i = 0; i < req->cnt; i++)
     {
-      block_sector_t sector = cache_sectors[victim_idx];
-      block_write (fs_device, sector, &cache_entries[victim_idx * BLOCK_SECTOR_SIZE]);
+      wb->run[i]->writing = false;
+      unpin_entry (wb->run[i]);
     }
+  cond_broadcast (&write_done, &lock);
+  lock_release (&lock);
 
-  bitmap_reset (dirty_map, victim_idx);
+  free (req->buffer);
+  free (wb);
+}
+
+/* Returns a free, clean, unpinned slot, evicting one if needed.
+   If every slot is in use, waits for one if WAIT is true, and
+   otherwise returns a null pointer.  The global lock must be
+   held; it may be released and reacquired while waiting for
+   slots or writing one back.
 
-  size_t cache_idx = victim_idx;
+   The clock hand victim_idx sweeps over the slots, giving every
+   slot referenced since the last sweep a second chance, so that
+   hot inode and indirect sectors survive streams of one-shot
+   data sectors.  Pinned slots and slots in transition are
+   skipped. */
+static struct cache_entry *
+pop_victim (bool wait)
+{
+  size_t checked = 0;
 
-  incr_victim_idx ();
+  ASSERT (lock_held_by_current_thread (&lock));
 
-  return cache_idx;
+  while (true)
+    {
+      struct cache_entry *entry = &cache_slots[victim_idx];
+
+      incr_victim_idx ();
+
+      if (entry->state == CACHE_FREE)
+        return entry;
+
+      if (entry->state == CACHE_VALID && entry->pin_cnt == 0)
+        {
+          if (entry->accessed)
+            entry->accessed = false;
+          else if (entry->dirty)
+            {
+              /* Write it back with the global lock released.  It
+                 stays cached and may be used meanwhile, so check
+                 it again on a later pass. */
+              entry->state = CACHE_EVICTING;
+              write_back (entry, false);
+              if (entry->state == CACHE_EVICTING)
+                entry->state = CACHE_VALID;
+            }
+          else
+            {
+              hash_delete (&cache_map, &entry->hash_elem);
+              entry->state = CACHE_FREE;
+              stats.evictions++;
+              if (entry->prefetched)
+                stats.read_ahead_wasted++;
+              return entry;
+            }
+        }
+
+      /* Every slot is pinned or in transition: wait for one. */
+      if (++checked >= 2 * cache_size)
+        {
+          if (!wait)
+            return NULL;
+          cond_wait (&slot_unpinned, &lock);
+          checked = 0;
+        }
+    }
 }
 
+/* Serves read-ahead requests queued by cache_read_ahead(),
+   sleeping while there are none.  Requests for consecutive
+   sectors are served together, and up to READ_AHEAD_INFLIGHT_MAX
+   transfers are kept in flight at once. */
 static void
 read_ahead_async (void *aux UNUSED)
 {
-  block_sector_t sector;
+  size_t inflight = 0;
 
   while (true)
     {
-      sector = read_ahead_sector;
+      struct prefetch *pf;
+      block_sector_t sector;
+      size_t cnt;
 
-      if (sector == CACHE_MAX)
-        timer_msleep (10);
+      lock_acquire (&read_ahead_lock);
 
-      lock_acquire (&lock);
+      while (list_empty (&read_ahead_done)
+             && (read_ahead_cnt == 0 || inflight >= READ_AHEAD_INFLIGHT_MAX))
+        cond_wait (&read_ahead_cond, &read_ahead_lock);
 
-      find_and_cache_read (sector);
-      read_ahead_sector = CACHE_MAX;
+      /* Finish transfers first: readers may be waiting for them. */
+      if (!list_empty (&read_ahead_done))
+        {
+          pf = list_entry (list_pop_front (&read_ahead_done),
+                           struct prefetch, elem);
+          lock_release (&read_ahead_lock);
 
-      lock_release (&lock);
+          finish_prefetch (pf);
+          inflight--;
+          continue;
+        }
+
+      sector = read_ahead_queue[read_ahead_head];
+      cnt = 0;
+      do
+        {
+          read_ahead_head = (read_ahead_head + 1) % READ_AHEAD_MAX;
+          read_ahead_cnt--;
+          cnt++;
+        }
+      while (cnt < CLUSTER_MAX && read_ahead_cnt > 0
+             && read_ahead_queue[read_ahead_head] == sector + cnt);
+
+      lock_release (&read_ahead_lock);
+
+      if (prefetch (sector, cnt) != NULL)
+        inflight++;
+    }
+}
+
+/* Starts bringing the CNT sectors starting at SECTOR into the
+   cache, reading the first run of them that is not cached yet
+   with a single transfer.  Prefetching does not count as a
+   reference for pop_victim, and gives up rather than wait for a
+   slot.
+
+   Returns the transfer, which is handed back to this thread to
+   finish, or a null pointer if the sectors were read
+   synchronously for lack of memory or there was nothing to
+   read. */
+static struct prefetch *
+prefetch (block_sector_t sector, size_t cnt)
+{
+  struct prefetch *pf;
+  uint8_t *buffer;
+  size_t run_cnt, i;
+
+  ASSERT (cnt <= CLUSTER_MAX);
+
+  pf = malloc (sizeof *pf);
+  if (pf == NULL)
+    return NULL;
+
+  cache_lock_acquire ();
+
+  for (; cnt > 0 && find_cache_entry (sector) != NULL; sector++, cnt--)
+    continue;
+
+  for (run_cnt = 0; run_cnt < cnt; run_cnt++)
+    {
+      struct cache_entry *victim;
+
+      if (find_cache_entry (sector + run_cnt) != NULL)
+        break;
+
+      /* pop_victim() may release the lock; if the sector got
+         cached meanwhile, VICTIM stays free. */
+      victim = pop_victim (false);
+      if (victim == NULL || find_cache_entry (sector + run_cnt) != NULL)
+        break;
+
+      bind_entry (victim, sector + run_cnt);
+      victim->prefetched = true;
+      pf->run[run_cnt] = victim;
+    }
+  stats.read_aheads += run_cnt;
+
+  lock_release (&lock);
+
+  if (run_cnt == 0)
+    {
+      free (pf);
+      return NULL;
+    }
+
+  pf->req.sector = sector;
+  pf->req.cnt = run_cnt;
+  pf->req.write = false;
+  pf->req.complete = prefetch_done;
+  pf->req.aux = pf;
+  pf->req.tag = BLOCK_TAG_READ_AHEAD;
+
+  buffer = malloc (run_cnt * BLOCK_SECTOR_SIZE);
+  if (buffer == NULL)
+    {
+      for (i = 0; i < run_cnt; i++)
+        block_transfer (fs_device, pf->run[i]->sector, 1, pf->run[i]->data,
+                        false, BLOCK_TAG_READ_AHEAD);
+      pf->req.buffer = NULL;
+      finish_prefetch (pf);
+      return NULL;
+    }
+
+  pf->req.buffer = buffer;
+  block_submit (fs_device, &pf->req);
+  return pf;
+}
+
+/* Completion function for read-ahead transfers: hands PF back
+   to the read_ahead_async thread, which holds its slots. */
+static void
+prefetch_done (struct block_request *req)
+{
+  struct prefetch *pf = req->aux;
+
+  lock_acquire (&read_ahead_lock);
+  list_push_back (&read_ahead_done, &pf->elem);
+  cond_signal (&read_ahead_cond, &read_ahead_lock);
+  lock_release (&read_ahead_lock);
+}
+
+/* Copies the data read by PF, if it is in a staging buffer, into
+   its slots and makes them available, then frees PF. */
+static void
+finish_prefetch (struct prefetch *pf)
+{
+  uint8_t *buffer = pf->req.buffer;
+  size_t i;
+
+  for (i = 0; i < pf->req.cnt; i++)
+    {
+      struct cache_entry *entry = pf->run[i];
+
+      if (buffer != NULL)
+        memcpy (entry->data, buffer + i * BLOCK_SECTOR_SIZE, BLOCK_SECTOR_SIZE);
+      entry->state = CACHE_VALID;
+      rwlock_write_release (&entry->rwlock);
     }
+
+  cache_lock_acquire ();
+  for (i = 0; i < pf->req.cnt; i++)
+    unpin_entry (pf->run[i]);
+  lock_release (&lock);
+
+  free (buffer);
+  free (pf);
 }
 
+/* Writes back up to WRITE_BEHIND_BATCH dirty slots in ascending
+   sector order, only those dirty for DIRTY_EXPIRE_TICKS if
+   EXPIRED_ONLY is true, and returns how many were picked.  If
+   ASYNC is true the writes are only submitted, as by
+   write_back().  The global lock must be held; it is released
+   during the writes. */
+static size_t
+write_behind (bool expired_only, bool async)
+{
+  struct cache_entry *batch[WRITE_BEHIND_BATCH];
+  int64_t now = timer_ticks ();
+  size_t batch_cnt = 0;
+  size_t i, j;
+
+  ASSERT (lock_held_by_current_thread (&lock));
+
+  /* Keep the WRITE_BEHIND_BATCH lowest eligible sectors, sorted by
+     insertion. */
+  for (i = 0; i < cache_size; i++)
+    {
+      struct cache_entry *entry = &cache_slots[i];
+
+      /* Pinned slots are skipped: they are in use, possibly
+         locked by the current thread through cache_get(). */
+      if (entry->state != CACHE_VALID || !entry->dirty || entry->pin_cnt > 0
+          || (expired_only && now - entry->dirty_since < DIRTY_EXPIRE_TICKS))
+        continue;
+
+      for (j = batch_cnt; j > 0 && batch[j - 1]->sector > entry->sector; j--)
+        if (j < WRITE_BEHIND_BATCH)
+          batch[j] = batch[j - 1];
+
+      if (j < WRITE_BEHIND_BATCH)
+        {
+          batch[j] = entry;
+          if (batch_cnt < WRITE_BEHIND_BATCH)
+            batch_cnt++;
+        }
+    }
+
+  /* A slot may be cleaned, or even evicted and rebound, while
+     the lock is released for an earlier write.  That is harmless:
+     write_back only writes a slot that is dirty, under the sector
+     it holds at the time. */
+  for (i = 0; i < batch_cnt; i++)
+    write_back (batch[i], async);
+
+  return batch_cnt;
+}
+
+/* Makes a writer that outruns write-behind write back dirty
+   slots itself until fewer than DIRTY_HARD_LIMIT are dirty. */
 static void
-flush_all_async (void *aux UNUSED)
+throttle_writers (void)
+{
+  cache_lock_acquire ();
+  while (dirty_cnt >= DIRTY_HARD_LIMIT && write_behind (false, false) > 0)
+    continue;
+  lock_release (&lock);
+}
+
+/* Write-behind daemon: periodically writes back slots that have
+   been dirty for too long, and keeps the number of dirty slots
+   below DIRTY_HIGH_WATER, a small batch at a time so that no
+   other cache user waits long on the global lock. */
+static void
+write_behind_async (void *aux UNUSED)
 {
   while (true)
     {
-      timer_msleep (10000);
+      timer_msleep (WRITE_BEHIND_PERIOD_MS);
 
-      cache_flush_all ();
+      cache_lock_acquire ();
+
+      while (dirty_cnt > DIRTY_HIGH_WATER && write_behind (false, true) > 0)
+        continue;
+
+      while (write_behind (true, true) > 0)
+        continue;
+
+      lock_release (&lock);
     }
 }
+
+static unsigned
+cache_hash_func (const struct hash_elem *a, void *aux UNUSED)
+{
+  struct cache_entry *entry = hash_entry (a, struct cache_entry, hash_elem);
+
+  return hash_int ((int) entry->sector);
+}
+
+static bool
+cache_less_func (const struct hash_elem *a, const struct hash_elem *b, void *aux UNUSED)
+{
+  struct cache_entry *entry_a = hash_entry (a, struct cache_entry, hash_elem);
+  struct cache_entry *entry_b = hash_entry (b, struct cache_entry, hash_elem);
+
+  return entry_a->sector < entry_b->sector;
+}
@@ -1,8 +1,22 @@
+#include <stdbool.h>
+#include <cache-stats.h>
 #include "devices/block.h"
 
+void cache_configure (size_t);
 void cache_init (void);
 void cache_read (struct block *, block_sector_t, void *);
 void cache_write (struct block *, block_sector_t, const void *);
+void cache_read_at (struct block *, block_sector_t, void *,
+                    size_t ofs, size_t size);
+void cache_write_at (struct block *, block_sector_t, const void *,
+                     size_t ofs, size_t size);
+void *cache_get (struct block *, block_sector_t, bool exclusive);
+void *cache_get_new (struct block *, block_sector_t);
+void cache_put (const void *, bool dirty);
+void cache_read_ahead (block_sector_t);
 void cache_flush (block_sector_t);
+void cache_discard (block_sector_t, size_t cnt);
 void cache_flush_all (void);
 
+void cache_get_stats (struct cache_stats *);
+void cache_print_stats (void);
@@ -14,6 +14,7 @@ struct block *fs_device;
 
 static void do_format (void);
 static struct dir *extract_dir (const char *name, char **filename);
+static bool allocate_inode_sector (struct dir *, block_sector_t *);
 
 /* Initializes the file system module.
    If FORMAT is true, reformats the file system. */
@@ -39,8 +40,9 @@ filesys_init (bool format)
 void
 filesys_done (void) 
 {
-  cache_flush_all ();
+  inode_done ();
   free_map_close ();
+  cache_flush_all ();
 }
 
 /* Creates a file named NAME with the given INITIAL_SIZE.
@@ -61,7 +63,7 @@ filesys_create (const char *name, off_t initial_size)
   ASSERT (filename != NULL);
 
   bool success = (dir != NULL
-                  && free_map_allocate (1, &inode_sector)
+                  && allocate_inode_sector (dir, &inode_sector)
                   && inode_create (inode_sector, initial_size, false)
                   && dir_add (dir, filename, inode_sector));
 
@@ -154,7 +156,8 @@ filesys_mkdir (const char *name)
     }
 
   block_sector_t sector;
-  free_map_allocate(1, &sector);
+  if (!allocate_inode_sector (dir, &sector))
+    return false;
   dir_create (sector, 16);
 
   ASSERT (dir != NULL);
@@ -197,6 +200,21 @@ filesys_chdir (const char *name)
 }
 
 
+/* Allocates a sector for the inode of a new file or directory in
+   DIR, and stores it into *SECTORP.  Prefers the first free
+   sector after DIR's inode, so that a directory, the inodes it
+   names, and the data that follows them stay close together.
+   Returns false if the disk is full, even after
+   inode_reclaim_space(). */
+static bool
+allocate_inode_sector (struct dir *dir, block_sector_t *sectorp)
+{
+  block_sector_t goal = inode_get_inumber (dir_get_inode (dir)) + 1;
+  return (free_map_allocate_extent (goal, 1, sectorp) == 1
+          || (inode_reclaim_space ()
+              && free_map_allocate_extent (goal, 1, sectorp) == 1));
+}
+
 /* Formats the file system. */
 static void
 do_format (void)
@@ -1,13 +1,45 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "devices/timer.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
 
+/* Protects everything here.  It is held while the free map file is
+   written, which is safe only because that never allocates: the
+   file's sectors are all allocated when it is created, and it never
+   grows.  Otherwise, writing into a hole in it would allocate a
+   sector and wait for this lock.  free_map_flush() checks this. */
+static struct lock free_map_lock;
+
+/* Sectors of the free map file that are out of date, one bit per
+   sector.  Allocating and releasing sectors only mark them, and
+   free_map_flush() writes them back later, so that a file that
+   grows one sector at a time doesn't rewrite the free map each
+   time. */
+static struct bitmap *dirty_sectors;
+
+/* Number of free map bits in one sector of its file. */
+#define BITS_PER_SECTOR (BLOCK_SECTOR_SIZE * 8)
+
+/* Longest run that free_map_allocate_extent() searches for in one
+   piece, which bounds the cost of its scan. */
+#define EXTENT_SCAN_MAX 64
+
+/* How often the free_map_flush_async daemon writes the free map's
+   out-of-date sectors into the buffer cache, whose own write-behind
+   daemon then takes them to disk. */
+#define FREE_MAP_FLUSH_PERIOD_MS 500
+
+static void free_map_flush_async (void *aux UNUSED);
+
 /* Initializes the free map. */
 void
 free_map_init (void) 
@@ -17,36 +49,140 @@ free_map_init (void)
     PANIC ("bitmap creation failed--file system device is too large");
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  dirty_sectors = bitmap_create (DIV_ROUND_UP (bitmap_size (free_map),
+                                               BITS_PER_SECTOR));
+  if (dirty_sectors == NULL)
+    PANIC ("bitmap creation failed--file system device is too large");
+  lock_init (&free_map_lock);
+}
+
+/* Marks as out of date the sectors of the free map file that
+   hold the bits for the CNT sectors starting at SECTOR.
+   free_map_lock must be held. */
+static void
+mark_dirty (block_sector_t sector, size_t cnt)
+{
+  size_t first = sector / BITS_PER_SECTOR;
+  size_t last = (sector + cnt - 1) / BITS_PER_SECTOR;
+
+  ASSERT (lock_held_by_current_thread (&free_map_lock));
+  bitmap_set_multiple (dirty_sectors, first, last - first + 1, true);
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
    the first into *SECTORP.
    Returns true if successful, false if not enough consecutive
-   sectors were available or if the free_map file could not be
-   written. */
+   sectors were available. */
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
-    {
-      bitmap_set_multiple (free_map, sector, cnt, false); 
-      sector = BITMAP_ERROR;
-    }
+  block_sector_t sector;
+
+  lock_acquire (&free_map_lock);
+  sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
+  if (sector != BITMAP_ERROR)
+    mark_dirty (sector, cnt);
+  lock_release (&free_map_lock);
   if (sector != BITMAP_ERROR)
     *sectorp = sector;
   return sector != BITMAP_ERROR;
 }
 
+/* Allocates between 1 and CNT consecutive sectors from the free
+   map, preferring a run that starts at GOAL, then a run of CNT
+   sectors (up to EXTENT_SCAN_MAX) after GOAL, then whatever is
+   free first.  Stores
+   the first sector into *SECTORP and returns the number of
+   sectors allocated, which is 0 if the disk is full. */
+size_t
+free_map_allocate_extent (block_sector_t goal, size_t cnt,
+                          block_sector_t *sectorp)
+{
+  size_t size = bitmap_size (free_map);
+  size_t start, n;
+
+  ASSERT (cnt > 0);
+
+  lock_acquire (&free_map_lock);
+  if (goal >= size)
+    goal = 0;
+  if (!bitmap_test (free_map, goal))
+    start = goal;
+  else
+    {
+      start = bitmap_scan (free_map, goal,
+                           cnt < EXTENT_SCAN_MAX ? cnt : EXTENT_SCAN_MAX,
+                           false);
+      if (start == BITMAP_ERROR)
+        start = bitmap_scan (free_map, goal, 1, false);
+      if (start == BITMAP_ERROR)
+        start = bitmap_scan (free_map, 0, 1, false);
+      if (start == BITMAP_ERROR)
+        {
+          lock_release (&free_map_lock);
+          return 0;
+        }
+    }
+
+  for (n = 1; n < cnt && start + n < size && !bitmap_test (free_map, start + n);
+       n++)
+    continue;
+
+  bitmap_set_multiple (free_map, start, n, true);
+  mark_dirty (start, n);
+  lock_release (&free_map_lock);
+  *sectorp = start;
+  return n;
+}
+
 /* Makes CNT sectors starting at SECTOR available for use. */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
+  lock_acquire (&free_map_lock);
   ASSERT (bitmap_all (free_map, sector, cnt));
   bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  if (cnt > 0)
+    mark_dirty (sector, cnt);
+  lock_release (&free_map_lock);
+}
+
+/* Returns true if writing sector SECTOR_IDX of the free map file
+   allocates nothing.  free_map_lock must be held. */
+static bool
+sector_allocated (size_t sector_idx)
+{
+  off_t ofs = sector_idx * BLOCK_SECTOR_SIZE;
+  off_t size = bitmap_file_size (free_map) - ofs;
+
+  ASSERT (lock_held_by_current_thread (&free_map_lock));
+  if (size > BLOCK_SECTOR_SIZE)
+    size = BLOCK_SECTOR_SIZE;
+  return inode_allocated (file_get_inode (free_map_file), ofs, size);
+}
+
+/* Writes the out-of-date sectors of the free map file back to
+   it, through the buffer cache.  Called periodically by the
+   free_map_flush_async daemon, and before the free map is
+   closed. */
+void
+free_map_flush (void)
+{
+  size_t i;
+
+  lock_acquire (&free_map_lock);
+  if (free_map_file != NULL)
+    for (i = bitmap_scan (dirty_sectors, 0, 1, true);
+         i != BITMAP_ERROR;
+         i = bitmap_scan (dirty_sectors, i + 1, 1, true))
+      {
+        ASSERT (sector_allocated (i));
+        if (!bitmap_write_range (free_map, free_map_file,
+                                 i * BLOCK_SECTOR_SIZE, BLOCK_SECTOR_SIZE))
+          PANIC ("can't write free map");
+        bitmap_reset (dirty_sectors, i);
+      }
+  lock_release (&free_map_lock);
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -58,13 +194,38 @@ free_map_open (void)
     PANIC ("can't open free map");
   if (!bitmap_read (free_map, free_map_file))
     PANIC ("can't read free map");
+  if (!inode_allocated (file_get_inode (free_map_file), 0,
+                        bitmap_file_size (free_map)))
+    PANIC ("free map file has holes");
+  thread_create ("free_map_flush_async", PRI_DEFAULT, free_map_flush_async,
+                 NULL);
+}
+
+/* Free map flush daemon: periodically writes the out-of-date
+   sectors of the free map file into the buffer cache.  Does
+   nothing once the free map is closed. */
+static void
+free_map_flush_async (void *aux UNUSED)
+{
+  while (true)
+    {
+      timer_msleep (FREE_MAP_FLUSH_PERIOD_MS);
+      free_map_flush ();
+    }
 }
 
 /* Writes the free map to disk and closes the free map file. */
 void
 free_map_close (void) 
 {
-  file_close (free_map_file);
+  struct file *file;
+
+  free_map_flush ();
+  lock_acquire (&free_map_lock);
+  file = free_map_file;
+  free_map_file = NULL;
+  lock_release (&free_map_lock);
+  file_close (file);
 }
 
 /* Creates a new free map file on disk and writes the free map to
@@ -76,10 +237,15 @@ free_map_create (void)
   if (!inode_create (FREE_MAP_SECTOR, bitmap_file_size (free_map), false))
     PANIC ("free map creation failed");
 
-  /* Write bitmap to file. */
+  /* Write bitmap to file.  The file starts out as a hole, so
+     writing it allocates its sectors, which marks part of it out
+     of date again. */
   free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
   if (free_map_file == NULL)
     PANIC ("can't open free map");
   if (!bitmap_write (free_map, free_map_file))
     PANIC ("can't write free map");
+  ASSERT (inode_allocated (file_get_inode (free_map_file), 0,
+                           bitmap_file_size (free_map)));
+  free_map_flush ();
 }
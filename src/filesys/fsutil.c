@@ -1,5 +1,6 @@
 #include "filesys/fsutil.h"
 #include <debug.h>
+#include <round.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,6 +8,7 @@
 #include "filesys/directory.h"
 #include "filesys/file.h"
 #include "filesys/filesys.h"
+#include "threads/interrupt.h"
 #include "threads/malloc.h"
 #include "threads/palloc.h"
 #include "threads/vaddr.h"
@@ -155,6 +157,10 @@ fsutil_extract (char **argv UNUSED)
   free (header);
 }
 
+/* Next sector to write in the ustar archive on the scratch
+   device. */
+static block_sector_t append_sector;
+
 /* Copies file FILE_NAME from the file system to the scratch
    device, in ustar format.
 
@@ -166,8 +172,7 @@ fsutil_extract (char **argv UNUSED)
 void
 fsutil_append (char **argv)
 {
-  static block_sector_t sector = 0;
-
+  block_sector_t sector = append_sector;
   const char *file_name = argv[1];
   void *buffer;
   struct file *src;
@@ -216,8 +221,65 @@ fsutil_append (char **argv)
   memset (buffer, 0, BLOCK_SECTOR_SIZE);
   block_write (dst, sector, buffer);
   block_write (dst, sector, buffer + 1);
+  append_sector = sector;
 
   /* Finish up. */
   file_close (src);
   free (buffer);
 }
+
+/* Stops block I/O tracing and, if a trace was recorded, appends
+   it to the ustar archive on the scratch device as "blktrace",
+   after any files written by fsutil_append().  Called at
+   shutdown, so it reports problems instead of panicking. */
+void
+fsutil_append_block_trace (void)
+{
+  size_t size = block_trace_stop ();
+  block_sector_t sector = append_sector;
+  struct block *dst;
+  uint8_t *buffer;
+  size_t ofs;
+
+  if (size == 0 || intr_get_level () == INTR_OFF)
+    return;
+
+  dst = block_get_role (BLOCK_SCRATCH);
+  if (dst == NULL)
+    {
+      printf ("No scratch device for block trace\n");
+      return;
+    }
+  if (sector + DIV_ROUND_UP (size, BLOCK_SECTOR_SIZE) + 2 > block_size (dst))
+    {
+      printf ("Scratch device too small for %zu-byte block trace\n", size);
+      return;
+    }
+  buffer = malloc (BLOCK_SECTOR_SIZE);
+  if (buffer == NULL)
+    {
+      printf ("Couldn't allocate buffer for block trace\n");
+      return;
+    }
+
+  printf ("Appending block trace to ustar archive on scratch device...\n");
+
+  ustar_make_header ("blktrace", USTAR_REGULAR, size, (char *) buffer);
+  block_write (dst, sector++, buffer);
+  for (ofs = 0; ofs < size; ofs += BLOCK_SECTOR_SIZE)
+    {
+      size_t chunk_size = (size - ofs < BLOCK_SECTOR_SIZE
+                           ? size - ofs : BLOCK_SECTOR_SIZE);
+      block_trace_read (buffer, ofs, chunk_size);
+      memset (buffer + chunk_size, 0, BLOCK_SECTOR_SIZE - chunk_size);
+      block_write (dst, sector++, buffer);
+    }
+
+  /* End-of-archive marker. */
+  memset (buffer, 0, BLOCK_SECTOR_SIZE);
+  block_write (dst, sector, buffer);
+  block_write (dst, sector + 1, buffer);
+  append_sector = sector;
+
+  free (buffer);
+}
@@ -1,4 +1,5 @@
 #include "filesys/inode.h"
+#include <hash.h>
 #include <list.h>
 #include <debug.h>
 #include <round.h>
@@ -7,30 +8,93 @@
 #include "filesys/free-map.h"
 #include "filesys/cache.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494eae11
 #define INODE_FILE_MAGIC 0x494e4f44
 #define INODE_DIR_MAGIC 0x494d4f34
 
-#define TOTAL_SECTORS 127
-#define DIRECT_SECTORS 123
-#define INDIRECT_SECTORS 3
+/* Identifies a node of an extent tree. */
+#define EXTENT_MAGIC 0x45585431
+
+/* Number of entries in the extent tree root kept in an inode, and
+   in each extent block below it. */
+#define INODE_EXTENTS 41
+#define BLOCK_EXTENTS 42
+
+/* Deepest extent tree supported, more than enough to map any
+   disk. */
+#define EXTENT_DEPTH_MAX 6
+
+/* Number of closed inodes kept in memory for reopening. */
+#define CLOSED_INODES_MAX 32
+
+/* Number of sectors reserved past the end of a growing file, so
+   that files written at the same time don't interleave. */
+#define PREALLOC_SECTORS 32
+
+/* Number of sectors the reclaim thread frees between writes of
+   the free map. */
+#define RECLAIM_BATCH 256
+
+/* Upper bound on the read-ahead window, in sectors. */
+#define READ_AHEAD_WINDOW_MAX 16
+
+/* An entry in an extent tree.  In a leaf, it maps the LENGTH
+   sectors of a file starting at sector index LOGICAL onto as
+   many consecutive disk sectors starting at START.  In an index
+   node, START is instead the extent block that maps the file
+   from LOGICAL up to where the next entry's subtree begins, and
+   LENGTH is unused. */
+struct extent
+  {
+    uint32_t logical;                   /* First sector index in file. */
+    uint32_t length;                    /* Number of sectors. */
+    block_sector_t start;               /* First disk sector or child. */
+  };
+
+/* Header of an extent tree node.  Its entries are sorted by
+   LOGICAL and do not overlap. */
+struct extent_header
+  {
+    uint16_t cnt;                       /* Number of entries in use. */
+    uint16_t depth;                     /* 0 for a leaf. */
+    uint32_t magic;                     /* EXTENT_MAGIC. */
+  };
 
 /* On-disk inode.
-   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+   Must be exactly BLOCK_SECTOR_SIZE bytes long.  The root of the
+   file's extent tree is stored here, so a file of up to
+   INODE_EXTENTS runs needs no other metadata.  Sectors of the
+   file that no extent maps are holes, which read as zeros. */
 struct inode_disk
   {
-    off_t length;                                         /* File size in bytes. */
-    unsigned magic;                                       /* Magic number. */
-    block_sector_t sectors[DIRECT_SECTORS];               /* Sector -> blob */
-    block_sector_t indirect_sectors[INDIRECT_SECTORS];    /* Indirect_inode_disk -> sector -> blob */
+    off_t length;                       /* File size in bytes. */
+    unsigned magic;                     /* Magic number. */
+    struct extent_header root;          /* Root of the extent tree. */
+    struct extent extents[INODE_EXTENTS]; /* Its entries. */
+    uint32_t unused;
+  };
+
+/* An extent tree node below the root, one sector long. */
+struct extent_block
+  {
+    struct extent_header header;
+    struct extent extents[BLOCK_EXTENTS];
   };
 
-struct indirect_inode_disk
+/* In-memory copy of the leaves of a file's extent tree, in file
+   order, so that translating a sector index takes no cache
+   traffic once it has been loaded. */
+struct extent_map
   {
-    unsigned magic;
-    block_sector_t sectors[TOTAL_SECTORS];
+    bool loaded;                        /* Has it been read from the tree? */
+    struct extent *extents;             /* Leaf extents, merged where possible. */
+    size_t cnt;                         /* Number of extents in use. */
+    size_t cap;                         /* Number of extents allocated. */
+    size_t hint;                        /* Extent that served the last lookup. */
   };
 
 /* Returns the number of sectors to allocate for an inode SIZE
@@ -41,156 +105,892 @@ bytes_to_sectors (off_t size)
   return DIV_ROUND_UP (size, BLOCK_SECTOR_SIZE);
 }
 
-/* In-memory inode. */
+/* In-memory inode.  Stays in memory for a while after its last
+   opener closes it, in case it is opened again soon.
+
+   RWLOCK protects DATA and MAP.  It is held for reading while
+   reading INODE or writing inside it, and for writing while
+   extending it or filling a hole in it, so that a reader never
+   sees a length that covers data not yet written.  LOCK serializes loading MAP, which
+   readers may race to do, and guards the read-ahead state.
+
+   While INODE is open, the PREALLOC_CNT sectors at PREALLOC_START
+   are allocated in the free map but belong to no file.  They are
+   where INODE grows next, and are released when it is closed, or
+   earlier by inode_reclaim_space() if the disk fills up.  Both
+   members are protected by prealloc_lock. */
 struct inode 
   {
-    struct list_elem elem;              /* Element in inode list. */
+    struct hash_elem hash_elem;         /* Element in inode_map. */
+    struct list_elem closed_elem;       /* In closed_inodes or reclaim_list. */
     block_sector_t sector;              /* Sector number of disk location. */
     int open_cnt;                       /* Number of openers. */
+    bool loading;                       /* DATA still being read from disk? */
+    struct condition loaded;            /* Signaled when LOADING goes false. */
     bool removed;                       /* True if deleted, false otherwise. */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
     struct inode_disk data;             /* Inode content. */
+    struct extent_map map;              /* Cached leaves of DATA's extent tree. */
+    block_sector_t prealloc_start;      /* First sector reserved for growth. */
+    size_t prealloc_cnt;                /* Number of sectors reserved. */
+
+    off_t ra_next_idx;                  /* Next sector index of a sequential read. */
+    off_t ra_end_idx;                   /* Read-ahead queued below this index. */
+    off_t ra_window;                    /* Read-ahead window, 0 if reads are random. */
+
+    struct rwlock rwlock;               /* Protects DATA and MAP. */
+    struct lock lock;                   /* Protects loading MAP, read-ahead. */
+    struct lock dir_lock;               /* Serializes directory updates. */
 
     unsigned magic;                     /* Inode magic number */
   };
 
-static bool
-fill_inode_disk_sector (struct inode_disk *disk_inode, off_t idx, bool fill_before)
+/* Returns the position of the last of the CNT entries in E whose
+   LOGICAL is at most IDX, or 0 if there is none. */
+static size_t
+find_entry (const struct extent *e, size_t cnt, uint32_t idx)
 {
-  static char zeros[BLOCK_SECTOR_SIZE];
+  size_t lo = 0, hi = cnt;
 
-  off_t direct_max_idx = DIRECT_SECTORS;
-  off_t indirect_max_idx = direct_max_idx + INDIRECT_SECTORS * TOTAL_SECTORS;
+  while (lo < hi)
+    {
+      size_t mid = (lo + hi) / 2;
+      if (e[mid].logical <= idx)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  return lo > 0 ? lo - 1 : 0;
+}
+
+/* Reads the extent block at SECTOR into BLOCK. */
+static void
+read_extent_block (block_sector_t sector, struct extent_block *block)
+{
+  cache_read (fs_device, sector, block);
+  ASSERT (block->header.magic == EXTENT_MAGIC);
+}
 
-  off_t indirect_idx = (idx - direct_max_idx) / TOTAL_SECTORS;
-  off_t indirect_sector_idx = (idx - direct_max_idx) % TOTAL_SECTORS;
+/* Returns the disk sector that holds sector IDX of the file whose
+   on-disk inode is DISK_INODE, or -1 if none is allocated. */
+static block_sector_t
+extent_lookup (const struct inode_disk *disk_inode, uint32_t idx)
+{
+  const struct extent_header *h = &disk_inode->root;
+  const struct extent *e = disk_inode->extents;
+  struct extent_block block;
+  size_t i;
 
-  if (idx < direct_max_idx)
+  while (h->cnt > 0 && h->depth > 0)
     {
-      if (disk_inode->sectors[idx] > 0)
-        return false;
+      read_extent_block (e[find_entry (e, h->cnt, idx)].start, &block);
+      h = &block.header;
+      e = block.extents;
+    }
 
-      free_map_allocate (1, &disk_inode->sectors[idx]);
-      cache_write (fs_device, disk_inode->sectors[idx], zeros);
+  if (h->cnt == 0)
+    return -1;
+  i = find_entry (e, h->cnt, idx);
+  if (idx < e[i].logical || idx - e[i].logical >= e[i].length)
+    return -1;
+  return e[i].start + (idx - e[i].logical);
+}
+
+/* Returns true if extent B continues extent A, both in the file
+   and on disk. */
+static bool
+extents_adjacent (const struct extent *a, const struct extent *b)
+{
+  return (a->logical + a->length == b->logical
+          && a->start + a->length == b->start);
+}
+
+/* Finds the hole in the file whose on-disk inode, at
+   INODE_SECTOR, is DISK_INODE, that contains the unmapped sector
+   index IDX.  Returns the index at which the hole ends, which is
+   UINT32_MAX if no extent follows it.  Stores into *GOAL the disk
+   sector at which IDX would continue the extent before the hole,
+   or the sector after INODE_SECTOR if there is none, so that
+   filling holes in any order can still yield one extent. */
+static uint32_t
+hole_bounds (const struct inode_disk *disk_inode, block_sector_t inode_sector,
+             uint32_t idx, block_sector_t *goal)
+{
+  const struct extent_header *h = &disk_inode->root;
+  const struct extent *e = disk_inode->extents;
+  struct extent_block block;
+  uint32_t end = UINT32_MAX;
+  size_t i;
+
+  *goal = inode_sector + 1;
+  if (h->cnt == 0)
+    return end;
+
+  /* Each index entry's LOGICAL is the first sector index mapped
+     below it, so the entry after the one followed on the way
+     down bounds the hole from above. */
+  for (;;)
+    {
+      i = find_entry (e, h->cnt, idx);
+      if (idx < e[i].logical)
+        return e[i].logical;
+      if (i + 1 < h->cnt && e[i + 1].logical < end)
+        end = e[i + 1].logical;
+      if (h->depth == 0)
+        break;
+      read_extent_block (e[i].start, &block);
+      h = &block.header;
+      e = block.extents;
     }
-  else if (idx < indirect_max_idx)
+
+  ASSERT (idx - e[i].logical >= e[i].length);
+  *goal = e[i].start + (idx - e[i].logical);
+  return end;
+}
+
+/* Discards the extents cached in MAP, so that the next lookup
+   reloads them from the tree. */
+static void
+map_clear (struct extent_map *map)
+{
+  free (map->extents);
+  map->loaded = false;
+  map->extents = NULL;
+  map->cnt = map->cap = 0;
+  map->hint = 0;
+}
+
+/* Adds E, which must not overlap any extent in MAP, to MAP,
+   merging it with the extents before and after it where they are
+   contiguous on disk.  Returns false if memory is short. */
+static bool
+map_insert (struct extent_map *map, const struct extent *e)
+{
+  struct extent *extents = map->extents;
+  size_t pos = 0;
+
+  if (map->cnt > 0)
     {
-      struct indirect_inode_disk *indirect_disk_inode;
-      indirect_disk_inode = calloc (1, sizeof *indirect_disk_inode);
+      pos = find_entry (extents, map->cnt, e->logical);
+      if (extents[pos].logical <= e->logical)
+        pos++;
+    }
 
-      if (disk_inode->indirect_sectors[indirect_idx] == 0)
+  if (pos > 0 && extents_adjacent (&extents[pos - 1], e))
+    {
+      extents[pos - 1].length += e->length;
+      if (pos < map->cnt && extents_adjacent (&extents[pos - 1], &extents[pos]))
         {
-          indirect_disk_inode->magic = INODE_FILE_MAGIC;
-
-          free_map_allocate (1, &disk_inode->indirect_sectors[indirect_idx]);
-          cache_write (fs_device, disk_inode->indirect_sectors[indirect_idx], indirect_disk_inode);
+          extents[pos - 1].length += extents[pos].length;
+          memmove (extents + pos, extents + pos + 1,
+                   (map->cnt - pos - 1) * sizeof *extents);
+          map->cnt--;
         }
+      return true;
+    }
+  if (pos < map->cnt && extents_adjacent (e, &extents[pos]))
+    {
+      extents[pos].logical = e->logical;
+      extents[pos].start = e->start;
+      extents[pos].length += e->length;
+      return true;
+    }
+
+  if (map->cnt == map->cap)
+    {
+      size_t cap = map->cap > 0 ? map->cap * 2 : 8;
+      extents = realloc (map->extents, cap * sizeof *extents);
+      if (extents == NULL)
+        return false;
+      map->extents = extents;
+      map->cap = cap;
+    }
+  memmove (extents + pos + 1, extents + pos, (map->cnt - pos) * sizeof *extents);
+  extents[pos] = *e;
+  map->cnt++;
+  return true;
+}
 
-      cache_read (fs_device, disk_inode->indirect_sectors[indirect_idx], indirect_disk_inode);
+/* Appends to MAP the leaf extents below the CNT entries E of an
+   extent tree node at DEPTH.  Returns false if memory is short. */
+static bool
+map_collect (struct extent_map *map, const struct extent *e, size_t cnt,
+             unsigned depth)
+{
+  size_t i;
 
-      ASSERT (indirect_disk_inode->magic == INODE_FILE_MAGIC);
+  for (i = 0; i < cnt; i++)
+    if (depth == 0)
+      {
+        if (!map_insert (map, &e[i]))
+          return false;
+      }
+    else
+      {
+        struct extent_block *block = malloc (sizeof *block);
+        bool ok;
 
-      if (indirect_disk_inode->sectors[indirect_sector_idx] == 0)
+        if (block == NULL)
+          return false;
+        read_extent_block (e[i].start, block);
+        ok = map_collect (map, block->extents, block->header.cnt, depth - 1);
+        free (block);
+        if (!ok)
+          return false;
+      }
+  return true;
+}
+
+/* Loads MAP from the extent tree of DISK_INODE, if it is not
+   loaded already.  Returns false if memory is short, in which
+   case MAP is left unloaded.  LOCK serializes threads that hold
+   the inode's rwlock only for reading. */
+static bool
+map_load (struct extent_map *map, const struct inode_disk *disk_inode,
+          struct lock *lock)
+{
+  bool ok = true;
+
+  if (map->loaded)
+    return true;
+
+  lock_acquire (lock);
+  if (!map->loaded)
+    {
+      if (map_collect (map, disk_inode->extents, disk_inode->root.cnt,
+                       disk_inode->root.depth))
         {
-          free_map_allocate (1, &indirect_disk_inode->sectors[indirect_sector_idx]);
-          cache_write (fs_device, indirect_disk_inode->sectors[indirect_sector_idx], zeros);
-          cache_write (fs_device, disk_inode->indirect_sectors[indirect_idx], indirect_disk_inode);
-          free (indirect_disk_inode);
+          barrier ();
+          map->loaded = true;
         }
       else
         {
-          free (indirect_disk_inode);
-          return false;
+          map_clear (map);
+          ok = false;
         }
     }
+  lock_release (lock);
+  return ok;
+}
+
+/* Returns the disk sector that holds sector IDX of the file that
+   loaded MAP, or -1 if none is allocated.  Tries the extent that
+   served the previous lookup and the one after it first, since
+   files are mostly accessed sequentially. */
+static block_sector_t
+map_lookup (struct extent_map *map, uint32_t idx)
+{
+  const struct extent *e;
+  size_t i = map->hint;
+
+  if (map->cnt == 0)
+    return -1;
+  if (i >= map->cnt || idx < map->extents[i].logical)
+    i = find_entry (map->extents, map->cnt, idx);
+  else if (idx - map->extents[i].logical >= map->extents[i].length)
+    {
+      if (i + 1 < map->cnt && idx >= map->extents[i + 1].logical)
+        i++;
+      if (idx - map->extents[i].logical >= map->extents[i].length)
+        i = find_entry (map->extents, map->cnt, idx);
+    }
+  map->hint = i;
 
-  while (fill_before && idx-- > 0)
+  e = &map->extents[i];
+  if (idx < e->logical || idx - e->logical >= e->length)
+    return -1;
+  return e->start + (idx - e->logical);
+}
+
+/* Extent blocks allocated before an insertion into an extent tree
+   starts, so that the insertion can't fail halfway through. */
+struct extent_reserve
   {
-    if (!fill_inode_disk_sector (disk_inode, idx, false))
-      break;
-  }
+    block_sector_t sectors[EXTENT_DEPTH_MAX + 1];
+    size_t cnt;
+  };
 
-  return true;
+/* Inserts E at position POS among the entries ENTRIES of the node
+   with header H, which has room for CAP entries.  If the node is
+   full, first moves its upper half into a new extent block taken
+   from RESERVE, and sets *SPLIT to the index entry for that block
+   and *DID_SPLIT to true. */
+static void
+node_add (struct extent_header *h, struct extent *entries, size_t cap,
+          size_t pos, const struct extent *e, struct extent_reserve *reserve,
+          struct extent *split, bool *did_split)
+{
+  struct extent_block *right;
+  block_sector_t sector;
+  size_t keep;
+
+  if (h->cnt < cap)
+    {
+      memmove (entries + pos + 1, entries + pos,
+               (h->cnt - pos) * sizeof *entries);
+      entries[pos] = *e;
+      h->cnt++;
+      return;
+    }
+
+  ASSERT (reserve->cnt > 0);
+  sector = reserve->sectors[--reserve->cnt];
+  right = cache_get_new (fs_device, sector);
+  /* Files mostly grow at the end, so an append leaves the full
+     node as it is instead of splitting it in half. */
+  keep = pos == h->cnt ? h->cnt : h->cnt / 2;
+  right->header.cnt = h->cnt - keep;
+  right->header.depth = h->depth;
+  right->header.magic = EXTENT_MAGIC;
+  memcpy (right->extents, entries + keep,
+          right->header.cnt * sizeof *entries);
+  h->cnt = keep;
+
+  if (pos < keep)
+    node_add (h, entries, cap, pos, e, NULL, NULL, NULL);
+  else
+    node_add (&right->header, right->extents, BLOCK_EXTENTS, pos - keep, e,
+              NULL, NULL, NULL);
+
+  split->logical = right->extents[0].logical;
+  split->length = 0;
+  split->start = sector;
+  *did_split = true;
+  cache_put (right, true);
 }
 
-/* Returns the block device sector that contains byte offset POS
-   within INODE.
-   Returns -1 if INODE does not contain data for a byte at offset
-   POS. */
-static block_sector_t
-byte_to_sector (struct inode *inode, off_t pos, size_t size, bool is_write)
+/* Inserts extent E into the subtree whose root node has header H
+   and CAP entries ENTRIES, merging it into the extents before and
+   after it in the same leaf when they are contiguous on disk.  If
+   the root node of the subtree has to be split, sets *SPLIT and
+   *DID_SPLIT as node_add() does.  RESERVE must hold a block for
+   every node that can split. */
+static void
+node_insert (struct extent_header *h, struct extent *entries, size_t cap,
+             const struct extent *e, struct extent_reserve *reserve,
+             struct extent *split, bool *did_split)
 {
-  ASSERT (inode != NULL);
+  *did_split = false;
 
-  if (!is_write && pos >= inode->data.length)
-    return -1;
+  if (h->depth == 0)
+    {
+      size_t pos = h->cnt > 0 ? find_entry (entries, h->cnt, e->logical) : 0;
+
+      if (h->cnt > 0 && entries[pos].logical <= e->logical)
+        pos++;
+      if (pos > 0 && extents_adjacent (&entries[pos - 1], e))
+        {
+          entries[pos - 1].length += e->length;
+          if (pos < h->cnt && extents_adjacent (&entries[pos - 1], &entries[pos]))
+            {
+              entries[pos - 1].length += entries[pos].length;
+              memmove (entries + pos, entries + pos + 1,
+                       (h->cnt - pos - 1) * sizeof *entries);
+              h->cnt--;
+            }
+          return;
+        }
+      if (pos < h->cnt && extents_adjacent (e, &entries[pos]))
+        {
+          /* The parent's index entry was already lowered to
+             E->LOGICAL if this is the leaf's first extent. */
+          entries[pos].logical = e->logical;
+          entries[pos].start = e->start;
+          entries[pos].length += e->length;
+          return;
+        }
+      node_add (h, entries, cap, pos, e, reserve, split, did_split);
+    }
+  else
+    {
+      size_t i = find_entry (entries, h->cnt, e->logical);
+      struct extent_block *child;
+      struct extent child_split;
+      bool child_did_split;
+
+      if (e->logical < entries[i].logical)
+        entries[i].logical = e->logical;
+
+      child = cache_get (fs_device, entries[i].start, true);
+      ASSERT (child->header.magic == EXTENT_MAGIC);
+      node_insert (&child->header, child->extents, BLOCK_EXTENTS, e,
+                   reserve, &child_split, &child_did_split);
+      cache_put (child, true);
+
+      if (child_did_split)
+        node_add (h, entries, cap, i + 1, &child_split, reserve,
+                  split, did_split);
+    }
+}
 
-  off_t direct_max_idx = DIRECT_SECTORS;
-  off_t indirect_max_idx = direct_max_idx + INDIRECT_SECTORS * TOTAL_SECTORS;
+/* Returns the most extent blocks that inserting an extent at
+   sector index IDX into DISK_INODE's tree can take: one to move a
+   full root down, and one for each full node below the root on
+   the way to IDX's leaf, since only a full node splits. */
+static size_t
+extent_blocks_needed (const struct inode_disk *disk_inode, uint32_t idx)
+{
+  size_t cnt = disk_inode->root.cnt == INODE_EXTENTS;
   block_sector_t sector;
-  struct indirect_inode_disk *indirect_disk_inode = NULL;
+  unsigned depth;
+
+  if (disk_inode->root.depth == 0)
+    return cnt;
+
+  sector = disk_inode->extents[find_entry (disk_inode->extents,
+                                           disk_inode->root.cnt, idx)].start;
+  for (depth = disk_inode->root.depth; depth > 0; depth--)
+    {
+      const struct extent_block *block = cache_get (fs_device, sector, false);
+
+      ASSERT (block->header.magic == EXTENT_MAGIC);
+      if (block->header.cnt == BLOCK_EXTENTS)
+        cnt++;
+      if (depth > 1)
+        sector = block->extents[find_entry (block->extents,
+                                            block->header.cnt, idx)].start;
+      cache_put (block, false);
+    }
+  return cnt;
+}
+
+/* Allocates CNT extent blocks into RESERVE.  Returns false, with
+   nothing allocated, if the disk is full. */
+static bool
+reserve_blocks (struct extent_reserve *reserve, size_t cnt)
+{
+  for (reserve->cnt = 0; reserve->cnt < cnt; reserve->cnt++)
+    if (!free_map_allocate (1, &reserve->sectors[reserve->cnt]))
+      {
+        while (reserve->cnt > 0)
+          free_map_release (reserve->sectors[--reserve->cnt], 1);
+        return false;
+      }
+  return true;
+}
 
-  off_t idx = pos / BLOCK_SECTOR_SIZE;
-  size_t oft = pos % BLOCK_SECTOR_SIZE;
+/* Adds extent E to the extent tree of DISK_INODE.  Returns false
+   if the extent blocks it may need can't be allocated, in which
+   case the tree is not changed. */
+static bool
+extent_insert (struct inode_disk *disk_inode, const struct extent *e)
+{
+  struct extent_reserve reserve;
+  struct extent split;
+  bool did_split;
+  size_t need;
+
+  ASSERT (disk_inode->root.depth < EXTENT_DEPTH_MAX);
+
+  /* Take every block the insertion could need up front, so that a
+     full disk can't leave a split half done. */
+  need = extent_blocks_needed (disk_inode, e->logical);
+  if (!reserve_blocks (&reserve, need)
+      && (!inode_reclaim_space () || !reserve_blocks (&reserve, need)))
+    return false;
+
+  /* A full root can't be split, so move its entries down into a
+     new block first and make the root point to it. */
+  if (disk_inode->root.cnt == INODE_EXTENTS)
+    {
+      struct extent_block *child;
+      block_sector_t sector = reserve.sectors[--reserve.cnt];
+
+      child = cache_get_new (fs_device, sector);
+      child->header = disk_inode->root;
+      memcpy (child->extents, disk_inode->extents,
+              sizeof disk_inode->extents);
+      cache_put (child, true);
+
+      disk_inode->root.cnt = 1;
+      disk_inode->root.depth++;
+      disk_inode->extents[0].length = 0;
+      disk_inode->extents[0].start = sector;
+    }
+
+  node_insert (&disk_inode->root, disk_inode->extents, INODE_EXTENTS,
+               e, &reserve, &split, &did_split);
+  ASSERT (!did_split);
 
-  if (is_write && pos >= inode->data.length)
+  /* Blocks for nodes that merged instead of splitting. */
+  while (reserve.cnt > 0)
+    free_map_release (reserve.sectors[--reserve.cnt], 1);
+  return true;
+}
+
+/* Removed inodes whose blocks the reclaim thread has yet to free,
+   oldest first.  Until then, their sectors stay allocated. */
+static struct list reclaim_list;
+static bool reclaim_busy;               /* Reclaim thread is freeing one. */
+static struct lock reclaim_lock;        /* Protects the above. */
+static struct condition reclaim_ready;  /* reclaim_list not empty. */
+static struct condition reclaim_idle;   /* Nothing left to reclaim. */
+
+/* Sectors freed since the free map was last written. */
+static size_t reclaim_cnt;
+
+static void inode_free (struct inode *);
+
+/* Drops the CNT sectors starting at SECTOR from the cache, without
+   writing them back, and frees them.  Writes the free map once
+   every RECLAIM_BATCH sectors.  Called only by the reclaim
+   thread. */
+static void
+release_sectors (block_sector_t sector, size_t cnt)
+{
+  cache_discard (sector, cnt);
+  free_map_release (sector, cnt);
+  reclaim_cnt += cnt;
+  if (reclaim_cnt >= RECLAIM_BATCH)
     {
-      size_t max_size = BLOCK_SECTOR_SIZE - oft;
-      inode->data.length = pos + (size < max_size ? size : max_size);
+      free_map_flush ();
+      reclaim_cnt = 0;
+    }
+}
 
-      ASSERT (idx < DIRECT_SECTORS + TOTAL_SECTORS * INDIRECT_SECTORS);
+/* Frees the sectors mapped by the CNT entries E of an extent tree
+   node at DEPTH, and the extent blocks below it. */
+static void
+extent_free (const struct extent *e, size_t cnt, unsigned depth)
+{
+  size_t i;
+
+  for (i = 0; i < cnt; i++)
+    if (depth == 0)
+      release_sectors (e[i].start, e[i].length);
+    else
+      {
+        struct extent_block *block = malloc (sizeof *block);
+        if (block == NULL)
+          PANIC ("can't allocate extent block to free file");
+        read_extent_block (e[i].start, block);
+        extent_free (block->extents, block->header.cnt, depth - 1);
+        free (block);
+        release_sectors (e[i].start, 1);
+      }
+}
 
-      fill_inode_disk_sector (&inode->data, idx, true);
+/* Frees the blocks of the removed inodes on reclaim_list, one at a
+   time, so that whoever closed them need not wait. */
+static void
+reclaim_async (void *aux UNUSED)
+{
+  for (;;)
+    {
+      struct inode *inode;
 
-      cache_write (fs_device, inode->sector, &inode->data);
+      lock_acquire (&reclaim_lock);
+      reclaim_busy = false;
+      while (list_empty (&reclaim_list))
+        {
+          cond_broadcast (&reclaim_idle, &reclaim_lock);
+          cond_wait (&reclaim_ready, &reclaim_lock);
+        }
+      inode = list_entry (list_pop_front (&reclaim_list),
+                          struct inode, closed_elem);
+      reclaim_busy = true;
+      lock_release (&reclaim_lock);
+
+      /* The inode sector goes last, so that its number cannot be
+         reused before its blocks are free. */
+      extent_free (inode->data.extents, inode->data.root.cnt,
+                   inode->data.root.depth);
+      release_sectors (inode->sector, 1);
+      free_map_flush ();
+      reclaim_cnt = 0;
+      inode_free (inode);
     }
+}
 
-  if (idx < direct_max_idx)
-    sector = inode->data.sectors[idx];
-  else if (idx < indirect_max_idx)
+/* Waits until the reclaim thread has freed the blocks of every
+   removed inode.  Returns true if there were any. */
+static bool
+wait_for_reclaim (void)
+{
+  bool waited = false;
+
+  lock_acquire (&reclaim_lock);
+  while (reclaim_busy || !list_empty (&reclaim_list))
     {
-      size_t indirect_idx;
-      indirect_disk_inode = calloc (1, sizeof *indirect_disk_inode);
+      cond_wait (&reclaim_idle, &reclaim_lock);
+      waited = true;
+    }
+  lock_release (&reclaim_lock);
+  return waited;
+}
 
-      idx -= direct_max_idx;
-      indirect_idx = idx / TOTAL_SECTORS;
-      sector = inode->data.indirect_sectors[indirect_idx];
+/* Protects the PREALLOC_START and PREALLOC_CNT of every inode, so
+   that inode_reclaim_space() can take back the preallocations of
+   inodes that other threads are writing. */
+static struct lock prealloc_lock;
 
-      cache_read (fs_device, sector, indirect_disk_inode);
+/* Returns INODE's preallocated sectors to the free map.
+   prealloc_lock must be held. */
+static void
+release_prealloc (struct inode *inode)
+{
+  ASSERT (lock_held_by_current_thread (&prealloc_lock));
+  if (inode->prealloc_cnt > 0)
+    free_map_release (inode->prealloc_start, inode->prealloc_cnt);
+  inode->prealloc_cnt = 0;
+}
 
-      ASSERT (indirect_disk_inode->magic == INODE_FILE_MAGIC);
+/* Allocates between 1 and CNT consecutive sectors for INODE at or
+   after GOAL, as free_map_allocate_extent() does, and stores the
+   first into *SECTORP.  If APPEND is true, the file is growing
+   at its end, so the sectors come out of INODE's preallocation
+   if it starts at GOAL, and otherwise a new preallocation is
+   reserved after them.  Returns the number of sectors allocated,
+   0 if the disk is full.  INODE's rwlock must be held for
+   writing. */
+static size_t
+allocate_sectors (struct inode *inode, block_sector_t goal, size_t cnt,
+                  bool append, block_sector_t *sectorp)
+{
+  size_t n;
 
-      sector = indirect_disk_inode->sectors[idx - indirect_idx * TOTAL_SECTORS];
+  if (!append)
+    return free_map_allocate_extent (goal, cnt, sectorp);
 
-      free (indirect_disk_inode);
+  lock_acquire (&prealloc_lock);
+  if (inode->prealloc_cnt > 0 && inode->prealloc_start == goal)
+    {
+      n = cnt < inode->prealloc_cnt ? cnt : inode->prealloc_cnt;
+      *sectorp = inode->prealloc_start;
+      inode->prealloc_start += n;
+      inode->prealloc_cnt -= n;
     }
   else
-    sector = -1;
+    {
+      release_prealloc (inode);
+      n = free_map_allocate_extent (goal, cnt + PREALLOC_SECTORS, sectorp);
+      if (n > cnt)
+        {
+          inode->prealloc_start = *sectorp + cnt;
+          inode->prealloc_cnt = n - cnt;
+          n = cnt;
+        }
+    }
+  lock_release (&prealloc_lock);
+  return n;
+}
+
+/* Allocates sectors for the hole in INODE that contains byte
+   offset POS, for as much of it as a write of SIZE bytes at POS
+   covers.  Only the first and last sectors allocated, if the
+   write covers them in part, are zeroed; the caller overwrites
+   the rest.  Returns the disk sector allocated for POS, or -1 if
+   the disk is full.  INODE's rwlock must be held for writing. */
+static block_sector_t
+fill_hole (struct inode *inode, off_t pos, size_t size)
+{
+  static char zeros[BLOCK_SECTOR_SIZE];
+  uint32_t idx = pos / BLOCK_SECTOR_SIZE;
+  uint32_t last = (pos + size - 1) / BLOCK_SECTOR_SIZE;
+  off_t end_pos = pos + size;
+  block_sector_t goal;
+  uint32_t end = hole_bounds (&inode->data, inode->sector, idx, &goal);
+  bool append = end == UINT32_MAX;
+  struct extent e;
+
+  if (end > last + 1)
+    end = last + 1;
+  e.length = allocate_sectors (inode, goal, end - idx, append, &e.start);
+  if (e.length == 0 && inode_reclaim_space ())
+    e.length = allocate_sectors (inode, goal, end - idx, append, &e.start);
+  if (e.length == 0)
+    return -1;
 
+  if (pos % BLOCK_SECTOR_SIZE != 0
+      || end_pos < (off_t) (idx + 1) * BLOCK_SECTOR_SIZE)
+    cache_write (fs_device, e.start, zeros);
+  if (e.length > 1
+      && end_pos < (off_t) (idx + e.length) * BLOCK_SECTOR_SIZE)
+    cache_write (fs_device, e.start + e.length - 1, zeros);
+
+  e.logical = idx;
+  if (!extent_insert (&inode->data, &e))
+    {
+      cache_discard (e.start, e.length);
+      free_map_release (e.start, e.length);
+      return -1;
+    }
+  if (inode->map.loaded && !map_insert (&inode->map, &e))
+    map_clear (&inode->map);
+  return e.start;
+}
+
+/* Returns the block device sector that contains byte offset POS
+   within INODE, or -1 if INODE has no data there, because POS is
+   past its end or in a hole, which reads as zeros.
+
+   If ALLOCATE is true, it is for a write of SIZE bytes at POS:
+   a hole at POS is filled, along with as much of the rest of the
+   hole as the write covers, and INODE is extended to cover as
+   much of the write as falls in POS's sector.  Then -1 means the
+   disk is full, and INODE's rwlock must be held for writing. */
+static block_sector_t
+byte_to_sector (struct inode *inode, off_t pos, size_t size, bool allocate)
+{
+  uint32_t idx = pos / BLOCK_SECTOR_SIZE;
+  block_sector_t sector;
+  bool changed = false;
+
+  ASSERT (inode != NULL);
+
+  if (!allocate && pos >= inode->data.length)
+    return -1;
+
+  if (map_load (&inode->map, &inode->data, &inode->lock))
+    sector = map_lookup (&inode->map, idx);
+  else
+    sector = extent_lookup (&inode->data, idx);
+  if (!allocate)
+    return sector;
+
+  ASSERT (rwlock_held_by_current_thread (&inode->rwlock));
+  if (sector == (block_sector_t) -1)
+    {
+      /* Write the inode back even if filling the hole failed,
+         since its extent tree may still have grown. */
+      sector = fill_hole (inode, pos, size);
+      changed = true;
+    }
+  if (sector != (block_sector_t) -1)
+    {
+      size_t max_size = BLOCK_SECTOR_SIZE - pos % BLOCK_SECTOR_SIZE;
+      off_t length = pos + (size < max_size ? size : max_size);
+      if (length > inode->data.length)
+        {
+          inode->data.length = length;
+          changed = true;
+        }
+    }
+  if (changed)
+    cache_write (fs_device, inode->sector, &inode->data);
   return sector;
 }
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+/* Sector -> in-memory inode, for every inode that is open or on
+   closed_inodes, so that opening a single inode twice returns the
+   same `struct inode'. */
+static struct hash inode_map;
+
+/* Inodes in inode_map that nobody has open, most recently closed
+   first.  Reopening one of them needs no allocation or disk
+   access. */
+static struct list closed_inodes;
+static size_t closed_cnt;
+
+/* Protects inode_map, closed_inodes, closed_cnt, and the
+   OPEN_CNT, LOADING, DENY_WRITE_CNT, and REMOVED of every
+   inode. */
+static struct lock inodes_lock;
+
+static unsigned
+inode_hash_func (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct inode *inode = hash_entry (e, struct inode, hash_elem);
+  return hash_int (inode->sector);
+}
+
+static bool
+inode_less_func (const struct hash_elem *a, const struct hash_elem *b,
+                 void *aux UNUSED)
+{
+  return (hash_entry (a, struct inode, hash_elem)->sector
+          < hash_entry (b, struct inode, hash_elem)->sector);
+}
 
 /* Initializes the inode module. */
 void
 inode_init (void) 
 {
-  list_init (&open_inodes);
+  hash_init (&inode_map, inode_hash_func, inode_less_func, NULL);
+  list_init (&closed_inodes);
+  closed_cnt = 0;
+  lock_init (&inodes_lock);
+  lock_init (&prealloc_lock);
+  list_init (&reclaim_list);
+  reclaim_busy = false;
+  lock_init (&reclaim_lock);
+  cond_init (&reclaim_ready);
+  cond_init (&reclaim_idle);
+  thread_create ("reclaim_async", PRI_DEFAULT, reclaim_async, NULL);
+}
+
+/* Returns the preallocated sectors of every inode in memory to
+   the free map.  Returns true if there were any. */
+static bool
+release_all_prealloc (void)
+{
+  struct hash_iterator i;
+  bool released = false;
+
+  lock_acquire (&inodes_lock);
+  lock_acquire (&prealloc_lock);
+  hash_first (&i, &inode_map);
+  while (hash_next (&i))
+    {
+      struct inode *inode = hash_entry (hash_cur (&i), struct inode,
+                                        hash_elem);
+      if (inode->prealloc_cnt > 0)
+        {
+          release_prealloc (inode);
+          released = true;
+        }
+    }
+  lock_release (&prealloc_lock);
+  lock_release (&inodes_lock);
+  return released;
+}
+
+/* Makes room on a full disk, by taking back the preallocated
+   sectors of every inode and waiting for the blocks of removed
+   inodes to be freed.  Returns true if that freed anything, in
+   which case a failed allocation is worth retrying. */
+bool
+inode_reclaim_space (void)
+{
+  bool released = release_all_prealloc ();
+  return wait_for_reclaim () || released;
+}
+
+/* Waits for the blocks of removed inodes to be freed, and returns
+   the preallocated sectors of every inode in memory to the free
+   map, so that they are not recorded as in use on disk.  Called
+   when the file system shuts down. */
+void
+inode_done (void)
+{
+  wait_for_reclaim ();
+  release_all_prealloc ();
+}
+
+/* Returns the in-memory inode for SECTOR, or a null pointer if
+   there is none.  inodes_lock must be held. */
+static struct inode *
+find_inode (block_sector_t sector)
+{
+  struct inode key;
+  struct hash_elem *e;
+
+  ASSERT (lock_held_by_current_thread (&inodes_lock));
+
+  key.sector = sector;
+  e = hash_find (&inode_map, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct inode, hash_elem) : NULL;
 }
 
 /* Initializes an inode with LENGTH bytes of data and
    writes the new inode to sector SECTOR on the file system
-   device.
+   device.  The data is one hole, which reads as zeros and takes
+   no disk space until it is written.
    Returns true if successful.
-   Returns false if memory or disk allocation fails. */
+   Returns false if memory allocation fails. */
 bool
 inode_create (block_sector_t sector, off_t length, bool is_dir)
 {
-  ASSERT (length < (DIRECT_SECTORS + INDIRECT_SECTORS * TOTAL_SECTORS) * BLOCK_SECTOR_SIZE);
-
   struct inode_disk *disk_inode = NULL;
   bool success = false;
 
@@ -199,19 +999,16 @@ inode_create (block_sector_t sector, off_t length, bool is_dir)
   /* If this assertion fails, the inode structure is not exactly
      one sector in size, and you should fix that. */
   ASSERT (sizeof *disk_inode == BLOCK_SECTOR_SIZE);
+  ASSERT (sizeof (struct extent_block) == BLOCK_SECTOR_SIZE);
 
   disk_inode = calloc (1, sizeof *disk_inode);
   if (disk_inode != NULL)
     {
-      size_t sectors = bytes_to_sectors (length);
       disk_inode->length = length;
       disk_inode->magic = is_dir ? INODE_DIR_MAGIC : INODE_FILE_MAGIC;
-
-      fill_inode_disk_sector (disk_inode, sectors - 1, true);
-
-      block_write (fs_device, sector, disk_inode);
+      disk_inode->root.magic = EXTENT_MAGIC;
+      cache_write (fs_device, sector, disk_inode);
       success = true;
-
       free (disk_inode);
     }
   return success;
@@ -223,34 +1020,63 @@ inode_create (block_sector_t sector, off_t length, bool is_dir)
 struct inode *
 inode_open (block_sector_t sector)
 {
-  struct list_elem *e;
   struct inode *inode;
 
-  /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e)) 
+  lock_acquire (&inodes_lock);
+
+  /* Check whether this inode is already in memory. */
+  inode = find_inode (sector);
+  if (inode != NULL)
     {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector) 
+      if (inode->open_cnt++ == 0)
         {
-          inode_reopen (inode);
-          return inode; 
+          list_remove (&inode->closed_elem);
+          closed_cnt--;
         }
+      while (inode->loading)
+        cond_wait (&inode->loaded, &inodes_lock);
+      lock_release (&inodes_lock);
+      return inode;
     }
 
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
   if (inode == NULL)
-    return NULL;
+    {
+      lock_release (&inodes_lock);
+      return NULL;
+    }
 
-  /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
+  /* Initialize.  The inode goes into inode_map before it is read,
+     marked as loading, so that the read is done without holding
+     inodes_lock and whoever opens it meanwhile waits for it. */
   inode->sector = sector;
   inode->open_cnt = 1;
+  inode->loading = true;
+  cond_init (&inode->loaded);
   inode->deny_write_cnt = 0;
   inode->removed = false;
   inode->magic = INODE_MAGIC;
+  inode->ra_next_idx = 0;
+  inode->ra_end_idx = 0;
+  inode->ra_window = 0;
+  inode->map.loaded = false;
+  inode->map.extents = NULL;
+  inode->map.cnt = inode->map.cap = 0;
+  inode->map.hint = 0;
+  inode->prealloc_cnt = 0;
+  rwlock_init (&inode->rwlock);
+  lock_init (&inode->lock);
+  lock_init (&inode->dir_lock);
+  hash_insert (&inode_map, &inode->hash_elem);
+  lock_release (&inodes_lock);
+
   cache_read (fs_device, inode->sector, &inode->data);
+
+  lock_acquire (&inodes_lock);
+  inode->loading = false;
+  cond_broadcast (&inode->loaded, &inodes_lock);
+  lock_release (&inodes_lock);
   return inode;
 }
 
@@ -259,7 +1085,12 @@ struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
-    inode->open_cnt++;
+    {
+      lock_acquire (&inodes_lock);
+      ASSERT (inode->open_cnt > 0);
+      inode->open_cnt++;
+      lock_release (&inodes_lock);
+    }
   return inode;
 }
 
@@ -270,60 +1101,70 @@ inode_get_inumber (const struct inode *inode)
   return inode->sector;
 }
 
-/* Closes INODE and writes it to disk.
-   If this was the last reference to INODE, frees its memory.
-   If INODE was also a removed inode, frees its blocks. */
+/* Frees INODE's memory. */
+static void
+inode_free (struct inode *inode)
+{
+  map_clear (&inode->map);
+  free (inode);
+}
+
+/* Closes INODE.  Its on-disk copy is always up to date.
+   If this was the last reference to INODE, releases its
+   preallocated sectors, and if it was removed, hands it to the
+   reclaim thread to free its blocks and memory.  Otherwise, keeps it on
+   closed_inodes for reopening, and frees the least recently
+   closed inode there if that makes too many. */
 void
 inode_close (struct inode *inode) 
 {
+  struct inode *victim = NULL;
+
   /* Ignore null pointer. */
   if (inode == NULL)
     return;
 
-  /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0)
+  lock_acquire (&inodes_lock);
+  ASSERT (inode->open_cnt > 0);
+  if (--inode->open_cnt > 0)
     {
-      /* Remove from inode list and release lock. */
-      list_remove (&inode->elem);
- 
-      /* Deallocate blocks if removed. */
-      if (inode->removed) 
-        {
-          cache_flush (inode->sector);
-          free_map_release (inode->sector, 1);
-          size_t i;
-          size_t cnt = bytes_to_sectors (inode->data.length);
-          size_t direct_cnt = cnt < DIRECT_SECTORS ? cnt : DIRECT_SECTORS;
-          size_t indirect_cnt = cnt > DIRECT_SECTORS ? (cnt - DIRECT_SECTORS) / TOTAL_SECTORS : 0;
-
-          for (i = 0; i < direct_cnt; i++)
-            {
-              cache_flush (inode->data.sectors[i]);
-              free_map_release (inode->data.sectors[i], 1);
-            }
+      lock_release (&inodes_lock);
+      return;
+    }
 
-          for (i = 0; i < indirect_cnt; i++)
-            {
-              size_t j;
-              size_t indirect_sector_cnt = (cnt - direct_cnt) % TOTAL_SECTORS - i * TOTAL_SECTORS;
-              struct indirect_inode_disk *indirect_disk_inode;
-              indirect_disk_inode = calloc (1, sizeof *indirect_disk_inode);
-              cache_read (fs_device, inode->data.indirect_sectors[i], indirect_disk_inode);
-
-              for (j = 0; j < indirect_sector_cnt; j++)
-                {
-                  cache_flush (indirect_disk_inode->sectors[j]);
-                  free_map_release (indirect_disk_inode->sectors[j], 1);
-                }
-
-              cache_flush (inode->data.indirect_sectors[i]);
-              free_map_release (inode->data.indirect_sectors[i], 1);
-              free (indirect_disk_inode);
-            }
-        }
+  /* With no openers left, nobody can be using the preallocation,
+     and nobody can reopen INODE while inodes_lock is held.  It is
+     released even if INODE stays on closed_inodes, so that only
+     files being written hold free sectors. */
+  lock_acquire (&prealloc_lock);
+  release_prealloc (inode);
+  lock_release (&prealloc_lock);
 
-      free (inode); 
+  if (inode->removed)
+    {
+      hash_delete (&inode_map, &inode->hash_elem);
+      lock_release (&inodes_lock);
+
+      lock_acquire (&reclaim_lock);
+      list_push_back (&reclaim_list, &inode->closed_elem);
+      cond_signal (&reclaim_ready, &reclaim_lock);
+      lock_release (&reclaim_lock);
+      return;
     }
+
+  inode->ra_next_idx = inode->ra_end_idx = inode->ra_window = 0;
+  list_push_front (&closed_inodes, &inode->closed_elem);
+  if (++closed_cnt > CLOSED_INODES_MAX)
+    {
+      victim = list_entry (list_pop_back (&closed_inodes),
+                           struct inode, closed_elem);
+      hash_delete (&inode_map, &victim->hash_elem);
+      closed_cnt--;
+    }
+  lock_release (&inodes_lock);
+
+  if (victim != NULL)
+    inode_free (victim);
 }
 
 /* Marks INODE to be deleted when it is closed by the last caller who
@@ -332,8 +1173,57 @@ void
 inode_remove (struct inode *inode) 
 {
   ASSERT (inode != NULL);
+  lock_acquire (&inodes_lock);
   inode->removed = true;
   inode->magic = 0;
+  lock_release (&inodes_lock);
+}
+
+/* Updates INODE's read-ahead state for a read of SIZE bytes at
+   OFFSET and queues the sectors that should be prefetched.
+   A read that starts where the previous one ended doubles the
+   read-ahead window, up to READ_AHEAD_WINDOW_MAX sectors; any
+   other read collapses it.  Prefetching is done by logical
+   sector index through INODE's sector map, so it follows the
+   file rather than the disk layout.  INODE's rwlock must be held
+   for reading. */
+static void
+read_ahead (struct inode *inode, off_t offset, off_t size)
+{
+  off_t first_idx = offset / BLOCK_SECTOR_SIZE;
+  off_t last_idx = (offset + size - 1) / BLOCK_SECTOR_SIZE;
+  off_t end_idx = bytes_to_sectors (inode_length (inode));
+  off_t idx, start_idx;
+
+  lock_acquire (&inode->lock);
+  if (first_idx == inode->ra_next_idx || first_idx + 1 == inode->ra_next_idx)
+    {
+      if (inode->ra_window == 0)
+        inode->ra_window = 1;
+      else if (inode->ra_window < READ_AHEAD_WINDOW_MAX)
+        inode->ra_window *= 2;
+    }
+  else
+    {
+      inode->ra_window = 0;
+      inode->ra_end_idx = 0;
+    }
+  inode->ra_next_idx = last_idx + 1;
+
+  start_idx = inode->ra_end_idx > last_idx + 1 ? inode->ra_end_idx : last_idx + 1;
+  end_idx = last_idx + inode->ra_window + 1 < end_idx
+            ? last_idx + inode->ra_window + 1 : end_idx;
+  if (end_idx > inode->ra_end_idx)
+    inode->ra_end_idx = end_idx;
+  lock_release (&inode->lock);
+
+  for (idx = start_idx; idx < end_idx; idx++)
+    {
+      block_sector_t sector = byte_to_sector (inode, idx * BLOCK_SECTOR_SIZE,
+                                              0, false);
+      if (sector != (block_sector_t) -1)
+        cache_read_ahead (sector);
+    }
 }
 
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
@@ -344,7 +1234,10 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
 {
   uint8_t *buffer = buffer_;
   off_t bytes_read = 0;
-  uint8_t *bounce = NULL;
+
+  rwlock_read_acquire (&inode->rwlock);
+  if (size > 0 && offset < inode_length (inode))
+    read_ahead (inode, offset, size);
 
   while (size > 0) 
     {
@@ -362,56 +1255,61 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
-        {
-          /* Read full sector directly into caller's buffer. */
-          cache_read (fs_device, sector_idx, buffer + bytes_read);
-        }
-      else 
-        {
-          /* Read sector into bounce buffer, then partially copy
-             into caller's buffer. */
-          if (bounce == NULL) 
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-          cache_read (fs_device, sector_idx, bounce);
-          memcpy (buffer + bytes_read, bounce + sector_ofs, chunk_size);
-        }
+      if (sector_idx != (block_sector_t) -1)
+        cache_read_at (fs_device, sector_idx, buffer + bytes_read,
+                       sector_ofs, chunk_size);
+      else
+        memset (buffer + bytes_read, 0, chunk_size);
       
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_read += chunk_size;
     }
-  free (bounce);
+  rwlock_read_release (&inode->rwlock);
 
   return bytes_read;
 }
 
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
    Returns the number of bytes actually written, which may be
-   less than SIZE if end of file is reached or an error occurs.
-   (Normally a write at end of file would extend the inode, but
-   growth is not yet implemented.) */
+   less than SIZE if the disk fills up.  A write at or past end of
+   file extends the inode, and a write into a hole fills it. */
 off_t
 inode_write_at (struct inode *inode, const void *buffer_, off_t size,
                 off_t offset) 
 {
   const uint8_t *buffer = buffer_;
   off_t bytes_written = 0;
-  uint8_t *bounce = NULL;
+  bool exclusive;
 
   if (inode->deny_write_cnt)
     return 0;
 
+  /* Files never shrink, so a write that starts out inside INODE
+     stays inside it and needs INODE's rwlock for writing only if
+     it runs into a hole. */
+  exclusive = offset + size > inode_length (inode);
+  if (exclusive)
+    rwlock_write_acquire (&inode->rwlock);
+  else
+    rwlock_read_acquire (&inode->rwlock);
+
   while (size > 0) 
     {
       /* Sector to write, starting byte offset within sector. */
-      block_sector_t sector_idx = byte_to_sector (inode, offset, size, true);
+      block_sector_t sector_idx = byte_to_sector (inode, offset, size,
+                                                  exclusive);
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
+      if (sector_idx == (block_sector_t) -1)
+        {
+          if (exclusive)
+            break;
+          rwlock_read_release (&inode->rwlock);
+          rwlock_write_acquire (&inode->rwlock);
+          exclusive = true;
+          continue;
+        }
 
       /* Bytes left in inode, bytes left in sector, lesser of the two. */
       off_t inode_left = inode_length (inode) - offset;
@@ -423,39 +1321,19 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
-        {
-          /* Write full sector directly to disk. */
-          cache_write (fs_device, sector_idx, buffer + bytes_written);
-        }
-      else 
-        {
-          /* We need a bounce buffer. */
-          if (bounce == NULL) 
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-
-          /* If the sector contains data before or after the chunk
-             we're writing, then we need to read in the sector
-             first.  Otherwise we start with a sector of all zeros. */
-          if (sector_ofs > 0 || chunk_size < sector_left) 
-            cache_read (fs_device, sector_idx, bounce);
-          else
-            memset (bounce, 0, BLOCK_SECTOR_SIZE);
-          memcpy (bounce + sector_ofs, buffer + bytes_written, chunk_size);
-          cache_write (fs_device, sector_idx, bounce);
-        }
+      cache_write_at (fs_device, sector_idx, buffer + bytes_written,
+                      sector_ofs, chunk_size);
 
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_written += chunk_size;
     }
-  free (bounce);
 
+  if (exclusive)
+    rwlock_write_release (&inode->rwlock);
+  else
+    rwlock_read_release (&inode->rwlock);
   return bytes_written;
 }
 
@@ -464,8 +1342,10 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
 void
 inode_deny_write (struct inode *inode) 
 {
+  lock_acquire (&inodes_lock);
   inode->deny_write_cnt++;
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
+  lock_release (&inodes_lock);
 }
 
 /* Re-enables writes to INODE.
@@ -474,9 +1354,29 @@ inode_deny_write (struct inode *inode)
 void
 inode_allow_write (struct inode *inode) 
 {
+  lock_acquire (&inodes_lock);
   ASSERT (inode->deny_write_cnt > 0);
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
   inode->deny_write_cnt--;
+  lock_release (&inodes_lock);
+}
+
+/* Returns true if the SIZE bytes of INODE starting at OFFSET all
+   lie within its length and outside any hole, so that writing
+   them allocates nothing. */
+bool
+inode_allocated (struct inode *inode, off_t offset, off_t size)
+{
+  off_t pos;
+  bool allocated;
+
+  rwlock_read_acquire (&inode->rwlock);
+  allocated = offset + size <= inode_length (inode);
+  for (pos = offset; allocated && pos < offset + size;
+       pos += BLOCK_SECTOR_SIZE - pos % BLOCK_SECTOR_SIZE)
+    allocated = byte_to_sector (inode, pos, 0, false) != (block_sector_t) -1;
+  rwlock_read_release (&inode->rwlock);
+  return allocated;
 }
 
 /* Returns the length, in bytes, of INODE's data. */
@@ -504,6 +1404,20 @@ inode_get_open_cnt (const struct inode *inode)
   return inode->open_cnt;
 }
 
+/* Acquires and releases the lock that serializes lookups and
+   updates of the directory whose inode is INODE. */
+void
+inode_lock_dir (struct inode *inode)
+{
+  lock_acquire (&inode->dir_lock);
+}
+
+void
+inode_unlock_dir (struct inode *inode)
+{
+  lock_release (&inode->dir_lock);
+}
+
 bool
 inode_verify (const struct inode *inode)
 {
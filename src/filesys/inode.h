@@ -8,6 +8,8 @@
 struct bitmap;
 
 void inode_init (void);
+void inode_done (void);
+bool inode_reclaim_space (void);
 bool inode_create (block_sector_t, off_t, bool);
 struct inode *inode_open (block_sector_t);
 struct inode *inode_reopen (struct inode *);
@@ -19,8 +21,11 @@ off_t inode_write_at (struct inode *, const void *, off_t size, off_t offset);
 void inode_deny_write (struct inode *);
 void inode_allow_write (struct inode *);
 off_t inode_length (const struct inode *);
+bool inode_allocated (struct inode *, off_t offset, off_t size);
 bool inode_isdir (const struct inode *);
 int inode_get_open_cnt (const struct inode *);
+void inode_lock_dir (struct inode *);
+void inode_unlock_dir (struct inode *);
 bool inode_verify (const struct inode *);
 
 #endif /* filesys/inode.h */
@@ -0,0 +1,33 @@
+#ifndef __LIB_BLOCK_STATS_H
+#define __LIB_BLOCK_STATS_H
+
+/* Block device roles, as passed to the block_stats() system
+   call.  These match the kernel's enum block_type. */
+#define BLOCK_STATS_KERNEL 0            /* Pintos OS kernel. */
+#define BLOCK_STATS_FILESYS 1           /* File system. */
+#define BLOCK_STATS_SCRATCH 2           /* Scratch. */
+#define BLOCK_STATS_SWAP 3              /* Swap. */
+
+/* Number of latency histogram buckets.  Bucket I counts requests
+   that took between 2**I and 2**(I+1) - 1 CPU cycles, except that
+   the last bucket also counts everything slower. */
+#define BLOCK_STATS_BUCKETS 40
+
+/* Request counters for one block device, kept by the kernel since
+   boot and returned to user programs by the block_stats() system
+   call.  Index 0 of the two-element arrays is for reads, index 1
+   for writes. */
+struct block_stats
+  {
+    unsigned long long requests[2];     /* Completed requests. */
+    unsigned long long sectors[2];      /* Sectors they transferred. */
+    unsigned long long latency_cycles[2]; /* Sum of their latencies. */
+    unsigned long long latency[2][BLOCK_STATS_BUCKETS]; /* Histograms. */
+    unsigned long long busy_cycles;     /* Time with requests in flight. */
+    unsigned long long depth_cycles;    /* Queue depth integrated over time. */
+    unsigned long long elapsed_cycles;  /* Time since the first request. */
+    unsigned depth;                     /* Requests in flight now. */
+    unsigned max_depth;                 /* Most requests ever in flight. */
+  };
+
+#endif /* lib/block-stats.h */
@@ -0,0 +1,54 @@
+#ifndef __LIB_BLOCK_TRACE_H
+#define __LIB_BLOCK_TRACE_H
+
+#include <stdint.h>
+
+/* Format of the block I/O trace that the kernel records with the
+   -blktrace option and writes to the scratch device at shutdown.
+   It is shared with utils/blktrace-replay, which runs on the
+   host, so it uses only fixed-size types laid out the same way by
+   32- and 64-bit compilers.
+
+   A trace is a struct block_trace_header followed by ENTRY_CNT
+   struct block_trace_entry, oldest first. */
+
+#define BLOCK_TRACE_MAGIC 0x43525442    /* "BTRC", little-endian. */
+#define BLOCK_TRACE_VERSION 1
+
+/* Who issued a block request. */
+enum block_tag
+  {
+    BLOCK_TAG_OTHER,                    /* Not otherwise classified. */
+    BLOCK_TAG_CACHE,                    /* Buffer cache demand read. */
+    BLOCK_TAG_READ_AHEAD,               /* Buffer cache read-ahead. */
+    BLOCK_TAG_WRITE_BACK,               /* Buffer cache write-back. */
+    BLOCK_TAG_INODE,                    /* Inode written around the cache. */
+    BLOCK_TAG_SWAP,                     /* Page swapped in or out. */
+    BLOCK_TAG_CNT
+  };
+
+struct block_trace_header
+  {
+    uint32_t magic;                     /* BLOCK_TRACE_MAGIC. */
+    uint32_t version;                   /* BLOCK_TRACE_VERSION. */
+    uint32_t entry_cnt;                 /* Entries that follow. */
+    uint32_t lost_cnt;                  /* Older entries overwritten. */
+    uint64_t cycles_per_tick;           /* CPU cycles per timer tick. */
+    uint32_t timer_freq;                /* Timer ticks per second. */
+    uint32_t reserved;
+  };
+
+/* One completed block request. */
+struct block_trace_entry
+  {
+    uint64_t start;                     /* CPU cycle it was submitted. */
+    uint32_t latency;                   /* Cycles until it completed. */
+    uint32_t sector;                    /* First sector. */
+    uint16_t cnt;                       /* Number of sectors. */
+    uint8_t role;                       /* Device role (enum block_type). */
+    uint8_t tag;                        /* Issuer (enum block_tag). */
+    uint8_t write;                      /* 1 for a write, 0 for a read. */
+    uint8_t reserved[3];
+  };
+
+#endif /* lib/block-trace.h */
@@ -0,0 +1,19 @@
+#ifndef __LIB_CACHE_STATS_H
+#define __LIB_CACHE_STATS_H
+
+/* Buffer cache counters, kept by the kernel since boot and
+   returned to user programs by the cache_stats() system call. */
+struct cache_stats
+  {
+    unsigned long long hits;            /* Lookups that found the sector cached. */
+    unsigned long long misses;          /* Lookups that had to load it. */
+    unsigned long long read_aheads;     /* Sectors prefetched by read-ahead. */
+    unsigned long long read_ahead_hits; /* Prefetched sectors later used. */
+    unsigned long long read_ahead_wasted; /* Prefetched sectors evicted unused. */
+    unsigned long long evictions;       /* Valid sectors evicted. */
+    unsigned long long writebacks;      /* Dirty sectors written back. */
+    unsigned long long lock_waits;      /* Contended cache lock acquisitions. */
+    unsigned long long lock_wait_cycles; /* CPU cycles spent waiting for it. */
+  };
+
+#endif /* lib/cache-stats.h */
@@ -28,7 +28,11 @@ enum
     SYS_MKDIR,                  /* Create a directory. */
     SYS_READDIR,                /* Reads a directory entry. */
     SYS_ISDIR,                  /* Tests if a fd represents a directory. */
-    SYS_INUMBER                 /* Returns the inode number for a fd. */
+    SYS_INUMBER,                /* Returns the inode number for a fd. */
+
+    /* Statistics. */
+    SYS_CACHE_STATS,            /* Reads buffer cache counters. */
+    SYS_BLOCK_STATS             /* Reads block device counters. */
   };
 
 #endif /* lib/syscall-nr.h */
@@ -182,3 +182,15 @@ inumber (int fd)
 {
   return syscall1 (SYS_INUMBER, fd);
 }
+
+void
+cache_stats (struct cache_stats *stats)
+{
+  syscall1 (SYS_CACHE_STATS, stats);
+}
+
+bool
+block_stats (int role, struct block_stats *stats)
+{
+  return syscall2 (SYS_BLOCK_STATS, role, stats);
+}
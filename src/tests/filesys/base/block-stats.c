@@ -0,0 +1,67 @@
+/* Checks the block_stats system call.  Writes and reads back a
+   file too large for the buffer cache, then verifies that the
+   file system device reports the reads and that its latency
+   histograms account for every request. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_SIZE 75678
+
+static char buf[FILE_SIZE];
+
+/* Fails unless STATS's latency histograms count each of its
+   requests exactly once. */
+static void
+check_histograms (const struct block_stats *stats)
+{
+  int dir;
+
+  for (dir = 0; dir < 2; dir++)
+    {
+      unsigned long long sum = 0;
+      int i;
+
+      for (i = 0; i < BLOCK_STATS_BUCKETS; i++)
+        sum += stats->latency[dir][i];
+      if (sum != stats->requests[dir])
+        fail ("%s histogram counts %llu requests, expected %llu",
+              dir ? "write" : "read", sum, stats->requests[dir]);
+    }
+}
+
+void
+test_main (void) 
+{
+  const char *file_name = "blocks";
+  struct block_stats before, after;
+  int fd;
+
+  CHECK (!block_stats (99, &before), "no device for bad role");
+  CHECK (block_stats (BLOCK_STATS_FILESYS, &before),
+         "file system device statistics");
+  check_histograms (&before);
+
+  random_init (0);
+  random_bytes (buf, sizeof buf);
+  CHECK (create (file_name, sizeof buf), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  CHECK (write (fd, buf, sizeof buf) == (int) sizeof buf,
+         "write \"%s\"", file_name);
+  seek (fd, 0);
+  CHECK (read (fd, buf, sizeof buf) == (int) sizeof buf,
+         "read \"%s\"", file_name);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+
+  CHECK (block_stats (BLOCK_STATS_FILESYS, &after),
+         "file system device statistics again");
+  check_histograms (&after);
+  if (after.requests[0] <= before.requests[0])
+    fail ("reading \"%s\" made no read requests", file_name);
+  if (after.max_depth == 0 || after.busy_cycles > after.elapsed_cycles)
+    fail ("implausible queue statistics");
+  msg ("statistics account for reading \"%s\"", file_name);
+}
@@ -0,0 +1,18 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(block-stats) begin
+(block-stats) no device for bad role
+(block-stats) file system device statistics
+(block-stats) create "blocks"
+(block-stats) open "blocks"
+(block-stats) write "blocks"
+(block-stats) read "blocks"
+(block-stats) close "blocks"
+(block-stats) file system device statistics again
+(block-stats) statistics account for reading "blocks"
+(block-stats) end
+EOF
+pass;
@@ -0,0 +1,7 @@
+/* Buffer cache hit microbenchmark, for a 1024-sector cache.
+   Same as cache-hit, but the "large" file is 512 sectors, so
+   comparing the two run times shows whether a hit gets slower
+   as the cache grows. */
+
+#define CACHE_SECTORS 1024
+#include "tests/filesys/base/cache-hit.inc"
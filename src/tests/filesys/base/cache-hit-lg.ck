@@ -0,0 +1,22 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(cache-hit-lg) begin
+(cache-hit-lg) create "small"
+(cache-hit-lg) open "small"
+(cache-hit-lg) write "small"
+(cache-hit-lg) create "large"
+(cache-hit-lg) open "large"
+(cache-hit-lg) write "large"
+(cache-hit-lg) read "small" 20 times
+(cache-hit-lg) reads of "small" hit the cache
+(cache-hit-lg) read "large" 20 times
+(cache-hit-lg) reads of "large" hit the cache
+(cache-hit-lg) close "small"
+(cache-hit-lg) close "large"
+(cache-hit-lg) open "small" for verification
+(cache-hit-lg) verified contents of "small"
+(cache-hit-lg) close "small"
+(cache-hit-lg) end
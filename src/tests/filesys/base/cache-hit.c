@@ -0,0 +1,9 @@
+/* Buffer cache hit microbenchmark, for the 64-sector cache.
+   Repeatedly reads back a small file and one that fills half the
+   cache, both of which stay resident, and checks with
+   cache_stats() that every read after a warm-up pass is a cache
+   hit.  The run time (the "Timer: # ticks" line printed at
+   shutdown) is then dominated by cache lookups. */
+
+#define CACHE_SECTORS 64
+#include "tests/filesys/base/cache-hit.inc"
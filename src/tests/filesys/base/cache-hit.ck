@@ -0,0 +1,22 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(cache-hit) begin
+(cache-hit) create "small"
+(cache-hit) open "small"
+(cache-hit) write "small"
+(cache-hit) create "large"
+(cache-hit) open "large"
+(cache-hit) write "large"
+(cache-hit) read "small" 20 times
+(cache-hit) reads of "small" hit the cache
+(cache-hit) read "large" 20 times
+(cache-hit) reads of "large" hit the cache
+(cache-hit) close "small"
+(cache-hit) close "large"
+(cache-hit) open "small" for verification
+(cache-hit) verified contents of "small"
+(cache-hit) close "small"
+(cache-hit) end
@@ -0,0 +1,50 @@
+/* Checks the cache_stats system call.  Writes a file that fits
+   in the buffer cache, then reads it back twice and verifies
+   that the counters report the second pass as cache hits. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define SECTOR_SIZE 512
+#define FILE_SECTORS 8
+
+static char buf[FILE_SECTORS * SECTOR_SIZE];
+
+void
+test_main (void) 
+{
+  const char *file_name = "stats";
+  struct cache_stats before, after;
+  int fd;
+
+  random_init (0);
+  random_bytes (buf, sizeof buf);
+
+  CHECK (create (file_name, sizeof buf), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  CHECK (write (fd, buf, sizeof buf) == (int) sizeof buf,
+         "write \"%s\"", file_name);
+
+  seek (fd, 0);
+  CHECK (read (fd, buf, sizeof buf) == (int) sizeof buf,
+         "read \"%s\"", file_name);
+
+  cache_stats (&before);
+  seek (fd, 0);
+  CHECK (read (fd, buf, sizeof buf) == (int) sizeof buf,
+         "read \"%s\" again", file_name);
+  cache_stats (&after);
+
+  if (after.hits - before.hits < FILE_SECTORS)
+    fail ("second read of \"%s\" made %llu cache hits, expected %d or more",
+          file_name, after.hits - before.hits, FILE_SECTORS);
+  if (after.misses != before.misses)
+    fail ("second read of \"%s\" made %llu cache misses, expected 0",
+          file_name, after.misses - before.misses);
+  msg ("second read of \"%s\" hit the cache", file_name);
+
+  msg ("close \"%s\"", file_name);
+  close (fd);
+}
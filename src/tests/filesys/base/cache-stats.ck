@@ -0,0 +1,16 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(cache-stats) begin
+(cache-stats) create "stats"
+(cache-stats) open "stats"
+(cache-stats) write "stats"
+(cache-stats) read "stats"
+(cache-stats) read "stats" again
+(cache-stats) second read of "stats" hit the cache
+(cache-stats) close "stats"
+(cache-stats) end
+EOF
+pass;
@@ -0,0 +1,5 @@
+/* Grows a file from 0 bytes to 500,000 bytes, 1,234 bytes at a
+   time, well past what an inode could map before extents. */
+
+#define TEST_SIZE 500000
+#include "tests/filesys/extended/grow-seq.inc"
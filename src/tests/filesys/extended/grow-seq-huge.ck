@@ -0,0 +1,17 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::random;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(grow-seq-huge) begin
+(grow-seq-huge) create "testme"
+(grow-seq-huge) open "testme"
+(grow-seq-huge) writing "testme"
+(grow-seq-huge) close "testme"
+(grow-seq-huge) open "testme" for verification
+(grow-seq-huge) verified contents of "testme"
+(grow-seq-huge) close "testme"
+(grow-seq-huge) end
+EOF
+pass;
@@ -0,0 +1,71 @@
+/* Creates a 900,000-byte file and writes one byte in its middle.
+   Measures the free space on the disk before and after, by
+   filling it with another file, and checks that the sparse file
+   took no more than its inode, the one sector written, and one
+   more sector for the directory entry, so that its unwritten
+   parts take no space. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define SPARSE_SIZE 900000
+#define CHUNK_SIZE 4096
+#define SECTOR_SIZE 512
+#define SPARSE_SECTORS 3
+
+static char buf[SPARSE_SIZE];
+
+/* Returns the number of bytes that fit in a new file, by writing
+   one until the disk is full.  Removes the file again. */
+static size_t
+free_space (void)
+{
+  const char *filler_name = "filler";
+  size_t size = 0;
+  int fd, n;
+
+  CHECK (create (filler_name, 0), "create \"%s\"", filler_name);
+  CHECK ((fd = open (filler_name)) > 1, "open \"%s\"", filler_name);
+  msg ("fill the disk with \"%s\"", filler_name);
+  do
+    {
+      n = write (fd, buf, CHUNK_SIZE);
+      if (n < 0)
+        fail ("write at offset %zu in \"%s\" failed", size, filler_name);
+      size += n;
+    }
+  while (n == CHUNK_SIZE);
+  msg ("close \"%s\"", filler_name);
+  close (fd);
+  CHECK (remove (filler_name), "remove \"%s\"", filler_name);
+  return size;
+}
+
+void
+test_main (void) 
+{
+  const char *sparse_name = "sparse";
+  size_t before, after;
+  char x = 'x';
+  int fd;
+
+  before = free_space ();
+
+  CHECK (create (sparse_name, SPARSE_SIZE), "create \"%s\"", sparse_name);
+  CHECK ((fd = open (sparse_name)) > 1, "open \"%s\"", sparse_name);
+  msg ("seek \"%s\"", sparse_name);
+  seek (fd, SPARSE_SIZE / 2);
+  CHECK (write (fd, &x, 1) == 1, "write \"%s\"", sparse_name);
+  msg ("close \"%s\"", sparse_name);
+  close (fd);
+
+  after = free_space ();
+  if (after > before || before - after > SPARSE_SECTORS * SECTOR_SIZE)
+    fail ("\"%s\" took %zu bytes of the disk, expected at most %d",
+          sparse_name, before - after, SPARSE_SECTORS * SECTOR_SIZE);
+  msg ("\"%s\" takes at most %d sectors", sparse_name, SPARSE_SECTORS);
+
+  buf[SPARSE_SIZE / 2] = x;
+  check_file (sparse_name, buf, SPARSE_SIZE);
+}
@@ -0,0 +1,26 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(grow-sparse-lg) begin
+(grow-sparse-lg) create "filler"
+(grow-sparse-lg) open "filler"
+(grow-sparse-lg) fill the disk with "filler"
+(grow-sparse-lg) close "filler"
+(grow-sparse-lg) remove "filler"
+(grow-sparse-lg) create "sparse"
+(grow-sparse-lg) open "sparse"
+(grow-sparse-lg) seek "sparse"
+(grow-sparse-lg) write "sparse"
+(grow-sparse-lg) close "sparse"
+(grow-sparse-lg) create "filler"
+(grow-sparse-lg) open "filler"
+(grow-sparse-lg) fill the disk with "filler"
+(grow-sparse-lg) close "filler"
+(grow-sparse-lg) remove "filler"
+(grow-sparse-lg) "sparse" takes at most 3 sectors
+(grow-sparse-lg) open "sparse" for verification
+(grow-sparse-lg) verified contents of "sparse"
+(grow-sparse-lg) close "sparse"
+(grow-sparse-lg) end
@@ -0,0 +1,73 @@
+/* Maps a file whose size is not a multiple of the page size and
+   rewrites it through the mapping while child-linear processes
+   force its pages out, reading the same file through a descriptor
+   meanwhile.  Checks that evictions do not move the descriptor's
+   position or write past the end of the file, and that the file
+   ends up holding what was last written to the mapping. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define CHILD_CNT 2
+#define SIZE (16 * 4096 + 1234)
+#define CHUNK_SIZE 1000
+#define PASS_CNT 16
+
+static char *map = (char *) 0x10000000;
+static char buf[SIZE];
+static char chunk[CHUNK_SIZE];
+
+void
+test_main (void)
+{
+  pid_t children[CHILD_CNT];
+  mapid_t mapid;
+  int map_fd, fd;
+  int pass;
+  size_t i;
+
+  random_init (0);
+  random_bytes (buf, sizeof buf);
+
+  CHECK (create ("data", 0), "create \"data\"");
+  CHECK ((fd = open ("data")) > 1, "open \"data\"");
+  CHECK (write (fd, buf, sizeof buf) == (int) sizeof buf, "write \"data\"");
+  CHECK ((map_fd = open ("data")) > 1, "open \"data\" again");
+  CHECK ((mapid = mmap (map_fd, map)) != MAP_FAILED, "mmap \"data\"");
+
+  for (i = 0; i < CHILD_CNT; i++)
+    CHECK ((children[i] = exec ("child-linear")) != -1,
+           "exec \"child-linear\"");
+
+  msg ("rewrite \"data\" through the mapping %d times", PASS_CNT);
+  for (pass = 0; pass < PASS_CNT; pass++)
+    {
+      size_t pos = pass * 4999 % SIZE;
+      size_t n = SIZE - pos < CHUNK_SIZE ? SIZE - pos : CHUNK_SIZE;
+
+      for (i = 0; i < SIZE; i++)
+        map[i] = buf[i] + pass;
+
+      seek (fd, pos);
+      if (read (fd, chunk, CHUNK_SIZE) != (int) n)
+        fail ("read at offset %zu failed on pass %d", pos, pass);
+      if (tell (fd) != pos + n)
+        fail ("position %u after read, expected %zu, on pass %d",
+              tell (fd), pos + n, pass);
+    }
+
+  for (i = 0; i < CHILD_CNT; i++)
+    CHECK (wait (children[i]) == 0x42, "wait for child %zu", i);
+
+  CHECK (filesize (fd) == SIZE, "size of \"data\" is still %d", SIZE);
+  msg ("munmap \"data\"");
+  munmap (mapid);
+  close (map_fd);
+  close (fd);
+
+  for (i = 0; i < SIZE; i++)
+    buf[i] += PASS_CNT - 1;
+  check_file ("data", buf, sizeof buf);
+}
@@ -0,0 +1,22 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(mmap-evict) begin
+(mmap-evict) create "data"
+(mmap-evict) open "data"
+(mmap-evict) write "data"
+(mmap-evict) open "data" again
+(mmap-evict) mmap "data"
+(mmap-evict) exec "child-linear"
+(mmap-evict) exec "child-linear"
+(mmap-evict) rewrite "data" through the mapping 16 times
+(mmap-evict) wait for child 0
+(mmap-evict) wait for child 1
+(mmap-evict) size of "data" is still 66770
+(mmap-evict) munmap "data"
+(mmap-evict) open "data" for verification
+(mmap-evict) verified contents of "data"
+(mmap-evict) close "data"
+(mmap-evict) end
@@ -0,0 +1,66 @@
+/* Copies a file while child-linear processes thrash memory, so
+   that swap traffic and file system traffic compete for the
+   disks.  With the swap and file system disks on different IDE
+   channels the two kinds of I/O should overlap; the run time
+   (the "Timer: # ticks" line printed at shutdown) is the
+   benchmark result. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define CHILD_CNT 2
+#define FILE_SIZE (64 * 1024)
+#define CHUNK_SIZE 4096
+#define COPY_CNT 8
+
+static char buf[FILE_SIZE];
+static char chunk[CHUNK_SIZE];
+
+void
+test_main (void)
+{
+  pid_t children[CHILD_CNT];
+  int copy;
+  int fd;
+  int i;
+
+  random_init (0);
+  random_bytes (buf, sizeof buf);
+
+  CHECK (create ("original", 0), "create \"original\"");
+  CHECK ((fd = open ("original")) > 1, "open \"original\"");
+  CHECK (write (fd, buf, sizeof buf) == (int) sizeof buf, "write \"original\"");
+  close (fd);
+
+  for (i = 0; i < CHILD_CNT; i++) 
+    CHECK ((children[i] = exec ("child-linear")) != -1,
+           "exec \"child-linear\"");
+
+  msg ("copy \"original\" to \"copy\" %d times", COPY_CNT);
+  for (copy = 0; copy < COPY_CNT; copy++)
+    {
+      int src, dst;
+      size_t ofs;
+
+      remove ("copy");
+      if (!create ("copy", 0))
+        fail ("create \"copy\" failed on pass %d", copy);
+      if ((src = open ("original")) < 2 || (dst = open ("copy")) < 2)
+        fail ("open failed on pass %d", copy);
+
+      for (ofs = 0; ofs < FILE_SIZE; ofs += CHUNK_SIZE)
+        if (read (src, chunk, CHUNK_SIZE) != CHUNK_SIZE
+            || write (dst, chunk, CHUNK_SIZE) != CHUNK_SIZE)
+          fail ("copy failed at offset %zu on pass %d", ofs, copy);
+
+      close (src);
+      close (dst);
+    }
+
+  for (i = 0; i < CHILD_CNT; i++) 
+    CHECK (wait (children[i]) == 0x42, "wait for child %d", i);
+
+  check_file ("copy", buf, sizeof buf);
+}
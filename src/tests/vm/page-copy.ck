@@ -0,0 +1,20 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(page-copy) begin
+(page-copy) create "original"
+(page-copy) open "original"
+(page-copy) write "original"
+(page-copy) exec "child-linear"
+(page-copy) exec "child-linear"
+(page-copy) copy "original" to "copy" 8 times
+(page-copy) wait for child 0
+(page-copy) wait for child 1
+(page-copy) open "copy" for verification
+(page-copy) verified contents of "copy"
+(page-copy) close "copy"
+(page-copy) end
+EOF
+pass;
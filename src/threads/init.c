@@ -36,6 +36,8 @@
 #ifdef FILESYS
 #include "devices/block.h"
 #include "devices/ide.h"
+#include "devices/ramdisk.h"
+#include "filesys/cache.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
 #endif
@@ -124,7 +126,9 @@ main (void)
 
 #ifdef FILESYS
   /* Initialize file system. */
+  block_trace_init ();
   ide_init ();
+  ramdisk_init ();
   locate_block_devices ();
   filesys_init (format_filesys);
 #endif
@@ -252,6 +256,12 @@ parse_options (char **argv)
         filesys_bdev_name = value;
       else if (!strcmp (name, "-scratch"))
         scratch_bdev_name = value;
+      else if (!strcmp (name, "-cache"))
+        cache_configure (atoi (value));
+      else if (!strcmp (name, "-ramdisk"))
+        ramdisk_configure (value);
+      else if (!strcmp (name, "-blktrace"))
+        block_trace_configure (value != NULL ? atoi (value) : 0);
 #ifdef VM
       else if (!strcmp (name, "-swap"))
         swap_bdev_name = value;
@@ -378,6 +388,9 @@ usage (void)
           "  -f                 Format file system device during startup.\n"
           "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
           "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+          "  -cache=N           Cache N disk sectors in memory (default 64).\n"
+          "  -ramdisk=ROLE:SIZE Use a SIZE-byte RAM disk (e.g. swap:4M) for ROLE.\n"
+          "  -blktrace[=N]      Trace last N block requests to scratch at exit.\n"
 #ifdef VM
           "  -swap=BDEV         Use BDEV for swap instead of default.\n"
 #endif
@@ -405,14 +418,16 @@ locate_block_devices (void)
 
 /* Figures out what block device to use for the given ROLE: the
    block device with the given NAME, if NAME is non-null,
-   otherwise the first block device in probe order of type
-   ROLE. */
+   otherwise the RAM disk created for ROLE, if any, otherwise the
+   first block device in probe order of type ROLE. */
 static void
 locate_block_device (enum block_type role, const char *name)
 {
   struct block *block = NULL;
 
-  if (name != NULL)
+  if (name == NULL && block_get_role (role) != NULL)
+    block = block_get_role (role);
+  else if (name != NULL)
     {
       block = block_get_by_name (name);
       if (block == NULL)
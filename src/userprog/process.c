@@ -20,6 +20,7 @@
 #include "threads/synch.h"
 #include "threads/vaddr.h"
 #include "vm/vm.h"
+#include "vm/frame.h"
 
 static thread_func start_process NO_RETURN;
 static bool load (const char *cmdline, void (**eip) (void), void **esp);
@@ -141,6 +142,10 @@ process_exit (void)
   struct thread *cur = thread_current ();
   uint32_t *pd;
 
+  /* Let no other thread evict our pages from here on, before
+     our mapped files and page directory go away. */
+  frame_release_owner (cur);
+
   vm_munmap_all ();
 
   sema_up (&cur->wait_sema);
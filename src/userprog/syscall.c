@@ -3,6 +3,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <syscall-nr.h>
+#include <block-stats.h>
+#include "devices/block.h"
 #include "devices/shutdown.h"
 #include "devices/input.h"
 #include "threads/interrupt.h"
@@ -10,6 +12,7 @@
 #include "filesys/file.h"
 #include "filesys/directory.h"
 #include "filesys/filesys.h"
+#include "filesys/cache.h"
 #include "threads/malloc.h"
 #include "threads/vaddr.h"
 #include "vm/vm.h"
@@ -36,27 +39,13 @@ static void syscall_mkdir (struct intr_frame *);
 static void syscall_readdir (struct intr_frame *);
 static void syscall_isdir (struct intr_frame *);
 static void syscall_inumber (struct intr_frame *);
-
-struct lock file_lock;
-
-static void
-syscall_file_lock_acquire (void)
-{
-  lock_acquire (&file_lock);
-}
-
-static void
-syscall_file_lock_release (void)
-{
-  lock_release (&file_lock);
-}
+static void syscall_cache_stats (struct intr_frame *);
+static void syscall_block_stats (struct intr_frame *);
 
 void
 syscall_init (void) 
 {
   intr_register_int (0x30, 3, INTR_ON, syscall_handler, "syscall");
-
-  lock_init (&file_lock);
 }
 
 static void
@@ -128,6 +117,12 @@ syscall_handler (struct intr_frame *f UNUSED)
     case SYS_INUMBER:
       syscall_inumber(f);
       break;
+    case SYS_CACHE_STATS:
+      syscall_cache_stats(f);
+      break;
+    case SYS_BLOCK_STATS:
+      syscall_block_stats(f);
+      break;
     default:
       ASSERT (false);
       break;
@@ -170,9 +165,7 @@ syscall_exec (struct intr_frame *f UNUSED)
   int *esp = f->esp;
   char *cmdline = (char *)*(esp + 1);
 
-  syscall_file_lock_acquire ();
   f->eax = process_execute (cmdline);
-  syscall_file_lock_release ();
 }
 
 static void
@@ -198,9 +191,7 @@ syscall_create (struct intr_frame *f UNUSED)
     return;
   }
 
-  syscall_file_lock_acquire ();
   f->eax = filesys_create (name, initial_size);
-  syscall_file_lock_release ();
 }
 
 static void
@@ -230,9 +221,7 @@ syscall_open (struct intr_frame *f UNUSED)
     return;
   }
 
-  syscall_file_lock_acquire ();
   struct file *file = filesys_open (name);
-  syscall_file_lock_release ();
 
   if (!file)
   {
@@ -301,9 +290,7 @@ syscall_read (struct intr_frame *f UNUSED)
 
   vm_pin_pages (buffer, size);
 
-  syscall_file_lock_acquire ();
   f->eax = file_read (file, buffer, size);
-  syscall_file_lock_release ();
 
   vm_unpin_pages (buffer, size);
 }
@@ -335,9 +322,7 @@ syscall_write (struct intr_frame *f UNUSED)
     return;
   }
 
-  syscall_file_lock_acquire ();
   f->eax = file_write (file, buffer, size);
-  syscall_file_lock_release ();
 }
 
 static void
@@ -390,9 +375,7 @@ syscall_mmap (struct intr_frame *f UNUSED)
       return;
     }
 
-  syscall_file_lock_acquire ();
   int mapid = vm_mmap (upage, file);
-  syscall_file_lock_release ();
 
   f->eax = mapid;
 }
@@ -403,9 +386,7 @@ syscall_munmap (struct intr_frame *f UNUSED)
   int *esp = f->esp;
   int mapid = *(esp + 1);
 
-  syscall_file_lock_acquire ();
   vm_munmap (mapid);
-  syscall_file_lock_release ();
 }
 
 static void
@@ -414,12 +395,8 @@ syscall_chdir (struct intr_frame *f)
   int *esp = f->esp;
   char *dirname = (char *)*(esp + 1);
 
-  syscall_file_lock_acquire ();
-
   bool success = filesys_chdir (dirname);
 
-  syscall_file_lock_release ();
-
   f->eax = success;
 }
 
@@ -436,12 +413,8 @@ syscall_mkdir (struct intr_frame *f)
     return;
   }
 
-  syscall_file_lock_acquire ();
-
   success = filesys_mkdir (dirname);
 
-  syscall_file_lock_release ();
-
   f->eax = success;
 }
 
@@ -516,3 +489,44 @@ syscall_inumber (struct intr_frame *f)
 
   f->eax = file_inumber (file);
 }
+
+static void
+syscall_cache_stats (struct intr_frame *f)
+{
+  int *esp = f->esp;
+  struct cache_stats *stats = (struct cache_stats *) *(esp + 1);
+
+  if (stats == NULL || (void *) (stats + 1) > PHYS_BASE)
+    {
+      syscall_exit_by_status (-1);
+      return;
+    }
+
+  vm_pin_pages (stats, sizeof *stats);
+  cache_get_stats (stats);
+  vm_unpin_pages (stats, sizeof *stats);
+}
+
+static void
+syscall_block_stats (struct intr_frame *f)
+{
+  int *esp = f->esp;
+  int role = *(esp + 1);
+  struct block_stats *stats = (struct block_stats *) *(esp + 2);
+
+  if (stats == NULL || (void *) (stats + 1) > PHYS_BASE)
+    {
+      syscall_exit_by_status (-1);
+      return;
+    }
+
+  if (role < 0 || role >= BLOCK_ROLE_CNT)
+    {
+      f->eax = false;
+      return;
+    }
+
+  vm_pin_pages (stats, sizeof *stats);
+  f->eax = block_get_stats (role, stats);
+  vm_unpin_pages (stats, sizeof *stats);
+}
@@ -0,0 +1,527 @@
+/* Replays a Pintos block I/O trace, as recorded by the kernel's
+   -blktrace option and copied out by "pintos --blktrace=FILE",
+   against a simple disk model.  It prints a summary of the trace,
+   then, for each device role, how the requests would have been
+   served under a chosen scheduling policy.  Optionally it first
+   filters the requests through a sector cache of a given size and
+   replacement policy, so that caching and scheduling choices can
+   be compared offline. */
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../lib/block-trace.h"
+
+/* Disk model, roughly a 7200 RPM disk: a seek costs a fixed
+   settle time plus a term growing with the square root of the
+   distance, a non-sequential access waits half a revolution on
+   average, and each sector takes a fixed transfer time. */
+#define SEEK_SETTLE_US 800.0
+#define SEEK_SQRT_US 8.0
+#define HALF_ROTATION_US 4167.0
+#define SECTOR_US 10.0
+
+#define ROLE_CNT 4                      /* Kernel, filesys, scratch, swap. */
+
+static const char *role_names[] = { "kernel", "filesys", "scratch", "swap" };
+static const char *tag_names[BLOCK_TAG_CNT] =
+  { "other", "cache", "read-ahead", "write-back", "inode", "swap" };
+
+/* A request as replayed. */
+struct request
+  {
+    double arrival;                     /* Submission time in microseconds. */
+    uint32_t sector;                    /* First sector. */
+    uint16_t cnt;                       /* Number of sectors. */
+    int role;                           /* Device role. */
+    int write;                          /* Write? */
+  };
+
+enum sched_policy { SCHED_FIFO, SCHED_SSTF, SCHED_CLOOK };
+enum cache_policy { CACHE_LRU, CACHE_FIFO };
+
+static const char *program_name;
+
+static void
+usage (void)
+{
+  fprintf (stderr,
+           "usage: %s [-s fifo|sstf|clook] [-c SECTORS] [-r lru|fifo] TRACE\n"
+           "  -s POLICY   disk scheduling policy to model (default clook)\n"
+           "  -c SECTORS  model a cache of SECTORS sectors in front of\n"
+           "              the disk (default: no cache)\n"
+           "  -r POLICY   replacement policy for -c (default lru)\n",
+           program_name);
+  exit (EXIT_FAILURE);
+}
+
+/* Reads the trace in FILE_NAME into *HEADER and a newly
+   allocated array of entries, which it returns. */
+static struct block_trace_entry *
+read_trace (const char *file_name, struct block_trace_header *header)
+{
+  struct block_trace_entry *entries;
+  FILE *file;
+
+  file = fopen (file_name, "rb");
+  if (file == NULL)
+    {
+      fprintf (stderr, "%s: %s: %s\n",
+               program_name, file_name, strerror (errno));
+      exit (EXIT_FAILURE);
+    }
+  if (fread (header, sizeof *header, 1, file) != 1
+      || header->magic != BLOCK_TRACE_MAGIC)
+    {
+      fprintf (stderr, "%s: %s: not a block trace\n", program_name, file_name);
+      exit (EXIT_FAILURE);
+    }
+  if (header->version != BLOCK_TRACE_VERSION)
+    {
+      fprintf (stderr, "%s: %s: unsupported trace version %u\n",
+               program_name, file_name, (unsigned) header->version);
+      exit (EXIT_FAILURE);
+    }
+
+  entries = calloc (header->entry_cnt + 1, sizeof *entries);
+  if (entries == NULL)
+    {
+      fprintf (stderr, "%s: out of memory\n", program_name);
+      exit (EXIT_FAILURE);
+    }
+  if (fread (entries, sizeof *entries, header->entry_cnt, file)
+      != header->entry_cnt)
+    {
+      fprintf (stderr, "%s: %s: trace is truncated\n",
+               program_name, file_name);
+      exit (EXIT_FAILURE);
+    }
+  fclose (file);
+  return entries;
+}
+
+/* Returns the number of microseconds in CYCLES CPU cycles, as
+   calibrated by HEADER, or 0 if the trace has no calibration. */
+static double
+cycles_to_us (const struct block_trace_header *header, uint64_t cycles)
+{
+  if (header->cycles_per_tick == 0 || header->timer_freq == 0)
+    return 0.0;
+  return (double) cycles * 1e6
+         / ((double) header->cycles_per_tick * header->timer_freq);
+}
+
+/* Prints, for each role and issuer, the requests in the trace
+   and their measured latency. */
+static void
+print_summary (const struct block_trace_header *header,
+               const struct block_trace_entry *entries)
+{
+  unsigned long long reqs[ROLE_CNT][BLOCK_TAG_CNT][2];
+  unsigned long long sectors[ROLE_CNT][BLOCK_TAG_CNT][2];
+  double latency[ROLE_CNT][BLOCK_TAG_CNT][2];
+  uint32_t i;
+  int role, tag, dir;
+
+  memset (reqs, 0, sizeof reqs);
+  memset (sectors, 0, sizeof sectors);
+  memset (latency, 0, sizeof latency);
+  for (i = 0; i < header->entry_cnt; i++)
+    {
+      const struct block_trace_entry *e = &entries[i];
+      if (e->role >= ROLE_CNT || e->tag >= BLOCK_TAG_CNT)
+        continue;
+      reqs[e->role][e->tag][e->write != 0]++;
+      sectors[e->role][e->tag][e->write != 0] += e->cnt;
+      latency[e->role][e->tag][e->write != 0]
+        += cycles_to_us (header, e->latency);
+    }
+
+  printf ("%u requests traced, %u older requests lost\n",
+          (unsigned) header->entry_cnt, (unsigned) header->lost_cnt);
+  printf ("%-8s %-10s %-5s %10s %10s %14s\n",
+          "role", "issuer", "op", "requests", "sectors", "measured us");
+  for (role = 0; role < ROLE_CNT; role++)
+    for (tag = 0; tag < BLOCK_TAG_CNT; tag++)
+      for (dir = 0; dir < 2; dir++)
+        if (reqs[role][tag][dir] != 0)
+          printf ("%-8s %-10s %-5s %10llu %10llu %14.1f\n",
+                  role_names[role], tag_names[tag], dir ? "write" : "read",
+                  reqs[role][tag][dir], sectors[role][tag][dir],
+                  latency[role][tag][dir] / reqs[role][tag][dir]);
+}
+
+/* A sector cache, kept as a list in replacement order with a
+   chained hash table for lookup. */
+struct cache_slot
+  {
+    uint64_t key;                       /* Role and sector. */
+    int prev, next;                     /* Replacement list, -1 at ends. */
+    int hash_next;                      /* Hash chain, -1 at end. */
+  };
+
+struct cache
+  {
+    enum cache_policy policy;
+    struct cache_slot *slots;
+    int *buckets;
+    int bucket_cnt;
+    int capacity, used;
+    int head, tail;                     /* Most and least recently used. */
+    unsigned long long hits, misses;
+  };
+
+static void
+cache_init (struct cache *c, int capacity, enum cache_policy policy)
+{
+  int i;
+
+  c->policy = policy;
+  c->capacity = capacity;
+  c->used = 0;
+  c->head = c->tail = -1;
+  c->hits = c->misses = 0;
+  for (c->bucket_cnt = 1; c->bucket_cnt < capacity; c->bucket_cnt *= 2)
+    continue;
+  c->slots = calloc (capacity, sizeof *c->slots);
+  c->buckets = malloc (c->bucket_cnt * sizeof *c->buckets);
+  if (c->slots == NULL || c->buckets == NULL)
+    {
+      fprintf (stderr, "%s: out of memory\n", program_name);
+      exit (EXIT_FAILURE);
+    }
+  for (i = 0; i < c->bucket_cnt; i++)
+    c->buckets[i] = -1;
+}
+
+static int *
+cache_bucket (struct cache *c, uint64_t key)
+{
+  return &c->buckets[(key * 0x9e3779b97f4a7c15ULL >> 32) & (c->bucket_cnt - 1)];
+}
+
+static void
+cache_unlink (struct cache *c, int i)
+{
+  struct cache_slot *s = &c->slots[i];
+
+  if (s->prev != -1)
+    c->slots[s->prev].next = s->next;
+  else
+    c->head = s->next;
+  if (s->next != -1)
+    c->slots[s->next].prev = s->prev;
+  else
+    c->tail = s->prev;
+}
+
+static void
+cache_push_front (struct cache *c, int i)
+{
+  struct cache_slot *s = &c->slots[i];
+
+  s->prev = -1;
+  s->next = c->head;
+  if (c->head != -1)
+    c->slots[c->head].prev = i;
+  c->head = i;
+  if (c->tail == -1)
+    c->tail = i;
+}
+
+/* Looks up sector KEY in cache C, counting a hit or a miss, and
+   makes sure it is cached afterward.  Returns true on a hit. */
+static int
+cache_access (struct cache *c, uint64_t key)
+{
+  int *bucket = cache_bucket (c, key);
+  int i;
+
+  for (i = *bucket; i != -1; i = c->slots[i].hash_next)
+    if (c->slots[i].key == key)
+      {
+        c->hits++;
+        if (c->policy == CACHE_LRU)
+          {
+            cache_unlink (c, i);
+            cache_push_front (c, i);
+          }
+        return 1;
+      }
+
+  c->misses++;
+  if (c->used < c->capacity)
+    i = c->used++;
+  else
+    {
+      /* Evict the tail and take its slot. */
+      int *p;
+
+      i = c->tail;
+      cache_unlink (c, i);
+      for (p = cache_bucket (c, c->slots[i].key); *p != i;
+           p = &c->slots[*p].hash_next)
+        continue;
+      *p = c->slots[i].hash_next;
+    }
+  c->slots[i].key = key;
+  c->slots[i].hash_next = *bucket;
+  *bucket = i;
+  cache_push_front (c, i);
+  return 0;
+}
+
+/* Returns the time in microseconds for the disk, with its head
+   just past sector HEAD, to serve R. */
+static double
+service_time (uint32_t head, const struct request *r)
+{
+  double t = r->cnt * SECTOR_US;
+
+  if (r->sector != head)
+    {
+      uint32_t distance = r->sector > head ? r->sector - head : head - r->sector;
+      t += SEEK_SETTLE_US + SEEK_SQRT_US * sqrt ((double) distance)
+           + HALF_ROTATION_US;
+    }
+  return t;
+}
+
+/* Returns the index in QUEUE, which has QUEUE_CNT elements, of
+   the request that POLICY serves next with the head at HEAD. */
+static int
+pick_request (struct request **queue, int queue_cnt, uint32_t head,
+              enum sched_policy policy)
+{
+  int best = 0;
+  int i;
+
+  for (i = 1; i < queue_cnt; i++)
+    {
+      const struct request *a = queue[i], *b = queue[best];
+
+      switch (policy)
+        {
+        case SCHED_FIFO:
+          if (a->arrival < b->arrival)
+            best = i;
+          break;
+
+        case SCHED_SSTF:
+          {
+            uint32_t da = a->sector > head ? a->sector - head : head - a->sector;
+            uint32_t db = b->sector > head ? b->sector - head : head - b->sector;
+            if (da < db)
+              best = i;
+          }
+          break;
+
+        case SCHED_CLOOK:
+          {
+            /* Ahead of the head in ascending order, then wrap. */
+            int a_ahead = a->sector >= head, b_ahead = b->sector >= head;
+            if (a_ahead != b_ahead ? a_ahead : a->sector < b->sector)
+              best = i;
+          }
+          break;
+        }
+    }
+  return best;
+}
+
+/* Replays the CNT requests in REQS, sorted by arrival, against
+   one modeled disk scheduled by POLICY, and prints the outcome
+   under NAME. */
+static void
+replay_disk (const char *name, struct request *reqs, int cnt,
+             enum sched_policy policy)
+{
+  struct request **queue;
+  int queue_cnt = 0;
+  int next = 0;
+  double now = 0.0, busy = 0.0, total_response = 0.0, max_response = 0.0;
+  unsigned long long seek_distance = 0, seeks = 0;
+  uint32_t head = 0;
+
+  if (cnt == 0)
+    return;
+
+  queue = malloc (cnt * sizeof *queue);
+  if (queue == NULL)
+    {
+      fprintf (stderr, "%s: out of memory\n", program_name);
+      exit (EXIT_FAILURE);
+    }
+
+  while (next < cnt || queue_cnt > 0)
+    {
+      struct request *r;
+      double response, t;
+      int i;
+
+      if (queue_cnt == 0 && reqs[next].arrival > now)
+        now = reqs[next].arrival;
+      while (next < cnt && reqs[next].arrival <= now)
+        queue[queue_cnt++] = &reqs[next++];
+
+      i = pick_request (queue, queue_cnt, head, policy);
+      r = queue[i];
+      queue[i] = queue[--queue_cnt];
+
+      if (r->sector != head)
+        {
+          seeks++;
+          seek_distance += r->sector > head ? r->sector - head : head - r->sector;
+        }
+      t = service_time (head, r);
+      now += t;
+      busy += t;
+      head = r->sector + r->cnt;
+
+      response = now - r->arrival;
+      total_response += response;
+      if (response > max_response)
+        max_response = response;
+    }
+  free (queue);
+
+  printf ("%-8s %8d requests, %8llu seeks averaging %.0f sectors, "
+          "busy %.1f ms, response %.1f us avg, %.1f us max\n",
+          name, cnt, seeks, seeks ? (double) seek_distance / seeks : 0.0,
+          busy / 1000.0, total_response / cnt, max_response);
+}
+
+/* Orders requests by arrival time. */
+static int
+compare_arrival (const void *a_, const void *b_)
+{
+  const struct request *a = a_, *b = b_;
+  return a->arrival < b->arrival ? -1 : a->arrival > b->arrival;
+}
+
+int
+main (int argc, char *argv[])
+{
+  enum sched_policy sched = SCHED_CLOOK;
+  enum cache_policy replacement = CACHE_LRU;
+  int cache_sectors = 0;
+  struct block_trace_header header;
+  struct block_trace_entry *entries;
+  struct request *reqs;
+  struct cache cache;
+  int req_cnt = 0;
+  uint32_t i;
+  int role, opt;
+
+  program_name = argv[0];
+  while ((opt = getopt (argc, argv, "s:c:r:")) != -1)
+    switch (opt)
+      {
+      case 's':
+        if (!strcmp (optarg, "fifo"))
+          sched = SCHED_FIFO;
+        else if (!strcmp (optarg, "sstf"))
+          sched = SCHED_SSTF;
+        else if (!strcmp (optarg, "clook"))
+          sched = SCHED_CLOOK;
+        else
+          usage ();
+        break;
+
+      case 'c':
+        cache_sectors = atoi (optarg);
+        if (cache_sectors <= 0)
+          usage ();
+        break;
+
+      case 'r':
+        if (!strcmp (optarg, "lru"))
+          replacement = CACHE_LRU;
+        else if (!strcmp (optarg, "fifo"))
+          replacement = CACHE_FIFO;
+        else
+          usage ();
+        break;
+
+      default:
+        usage ();
+      }
+  if (optind != argc - 1)
+    usage ();
+
+  entries = read_trace (argv[optind], &header);
+  print_summary (&header, entries);
+
+  /* Convert to requests, dropping cache hits if modeling a
+     cache.  A request is served from the cache only if all of its
+     sectors are; writes always go to the disk. */
+  reqs = calloc (header.entry_cnt + 1, sizeof *reqs);
+  if (reqs == NULL)
+    {
+      fprintf (stderr, "%s: out of memory\n", program_name);
+      exit (EXIT_FAILURE);
+    }
+  if (cache_sectors > 0)
+    cache_init (&cache, cache_sectors, replacement);
+  for (i = 0; i < header.entry_cnt; i++)
+    {
+      const struct block_trace_entry *e = &entries[i];
+      struct request *r = &reqs[req_cnt];
+
+      if (e->role >= ROLE_CNT)
+        continue;
+      if (cache_sectors > 0)
+        {
+          int all_hit = 1;
+          uint32_t s;
+
+          for (s = 0; s < e->cnt; s++)
+            if (!cache_access (&cache, ((uint64_t) e->role << 32)
+                                       | (e->sector + s)))
+              all_hit = 0;
+          if (all_hit && !e->write)
+            continue;
+        }
+
+      r->arrival = cycles_to_us (&header, e->start);
+      r->sector = e->sector;
+      r->cnt = e->cnt;
+      r->role = e->role;
+      r->write = e->write;
+      req_cnt++;
+    }
+  qsort (reqs, req_cnt, sizeof *reqs, compare_arrival);
+
+  if (cache_sectors > 0)
+    printf ("\n%d-sector %s cache: %llu hits, %llu misses (%.1f%% hits)\n",
+            cache_sectors, replacement == CACHE_LRU ? "LRU" : "FIFO",
+            cache.hits, cache.misses,
+            cache.hits + cache.misses
+            ? 100.0 * cache.hits / (cache.hits + cache.misses) : 0.0);
+
+  printf ("\n%s scheduling:\n",
+          sched == SCHED_FIFO ? "FIFO" : sched == SCHED_SSTF ? "SSTF" : "C-LOOK");
+  for (role = 0; role < ROLE_CNT; role++)
+    {
+      struct request *role_reqs = malloc ((req_cnt + 1) * sizeof *role_reqs);
+      int role_cnt = 0;
+      int j;
+
+      if (role_reqs == NULL)
+        {
+          fprintf (stderr, "%s: out of memory\n", program_name);
+          exit (EXIT_FAILURE);
+        }
+      for (j = 0; j < req_cnt; j++)
+        if (reqs[j].role == role)
+          role_reqs[role_cnt++] = reqs[j];
+      replay_disk (role_names[role], role_reqs, role_cnt, sched);
+      free (role_reqs);
+    }
+
+  return EXIT_SUCCESS;
+}
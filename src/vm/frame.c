@@ -1,39 +1,85 @@
 #include "vm/frame.h"
 #include "vm/swap.h"
 #include <stdio.h>
+#include <string.h>
 #include <list.h>
 #include "threads/vaddr.h"
 #include "threads/palloc.h"
+#include "threads/synch.h"
 #include "userprog/pagedir.h"
 #include "filesys/file.h"
 
+/* The frame lock protects the lists below and the is_evictable
+   and is_evicting members of every page.  It is never held
+   during I/O, so that a thread swapping a page out does not
+   keep other threads from faulting pages in from the file
+   system, or evicting to swap on another disk, at the same
+   time. */
 static struct lock lock;
-static struct list page_list;
+static struct list page_list;           /* Evictable pages, oldest first. */
+static struct list evicting_list;       /* Pages being written out. */
+static struct condition eviction_done;  /* Broadcast when one finishes. */
 
 static struct page *pop_victim (void);
+static void wait_for_eviction (struct page *page);
 
 void
 frame_init (void)
 {
   list_init (&page_list);
+  list_init (&evicting_list);
   lock_init (&lock);
+  cond_init (&eviction_done);
 }
 
 bool
 frame_load_page (struct page *page)
 {
+  void *kpage;
+
   lock_acquire (&lock);
 
-  void *kpage = palloc_get_page (page->flags);
+  wait_for_eviction (page);
 
-  if (kpage == NULL)
+  while ((kpage = palloc_get_page (page->flags)) == NULL)
     {
-      swap_out (pop_victim ());
-      kpage = palloc_get_page (page->flags);
+      struct page *victim;
+
+      /* Every evictable frame may be on its way out already, in
+         which case wait for one of those evictions to finish and
+         look again. */
+      if (list_empty (&page_list))
+        {
+          if (list_empty (&evicting_list))
+            PANIC ("out of frames");
+          cond_wait (&eviction_done, &lock);
+          continue;
+        }
+
+      /* Take over the victim's frame once it is written out.  The
+         victim is unmapped already, so its owner faults on it and
+         waits for us in wait_for_eviction(). */
+      victim = pop_victim ();
+
+      lock_release (&lock);
+      swap_out (victim);
+      lock_acquire (&lock);
+
+      kpage = victim->kaddr;
+      victim->kaddr = NULL;
+      victim->is_evicting = false;
+      list_remove (&victim->frame_elem);
+      cond_broadcast (&eviction_done, &lock);
+
+      if (page->flags & PAL_ZERO)
+        memset (kpage, 0, PGSIZE);
+      break;
     }
 
   page->kaddr = kpage;
 
+  lock_release (&lock);
+
   if (page->is_swapped &&
       (page->file == NULL || (page->file != NULL && page->file->mapid <= 0)))
     {
@@ -41,10 +87,10 @@ frame_load_page (struct page *page)
     }
   else if (page->file != NULL)
     {
-      int pos = file_tell (page->file);
-
-      file_read (page->file, page->kaddr, PGSIZE);
-      file_seek (page->file, pos);
+      file_read_at (page->file, page->kaddr, page->file_bytes,
+                    page->file_ofs);
+      memset ((uint8_t *) page->kaddr + page->file_bytes, 0,
+              PGSIZE - page->file_bytes);
 
       page->is_swapped = false;
     }
@@ -52,10 +98,15 @@ frame_load_page (struct page *page)
   pagedir_set_dirty (page->owner->pagedir, page->uaddr, false);
   pagedir_set_accessed (page->owner->pagedir, page->uaddr, false);
 
+  lock_acquire (&lock);
+
   page->is_loaded = true;
 
   if (page->writable)
-    list_push_back (&page_list, &page->frame_elem);
+    {
+      list_push_back (&page_list, &page->frame_elem);
+      page->is_evictable = true;
+    }
   
   lock_release (&lock);
 
@@ -65,8 +116,17 @@ frame_load_page (struct page *page)
 void
 frame_free_page (struct page *page)
 {
-  if (page->writable && page->is_loaded)
-    list_remove (&page->frame_elem);
+  lock_acquire (&lock);
+
+  wait_for_eviction (page);
+
+  if (page->is_evictable)
+    {
+      list_remove (&page->frame_elem);
+      page->is_evictable = false;
+    }
+
+  lock_release (&lock);
 
   if (!page->is_swapped)
     return;
@@ -75,6 +135,54 @@ frame_free_page (struct page *page)
     swap_free (page);
 }
 
+/* Makes the pages of thread T ineligible for eviction, waiting
+   for any of them being written out.  Called when T exits,
+   before its page directory and mapped files go away. */
+void
+frame_release_owner (struct thread *t)
+{
+  struct list_elem *e, *next;
+
+  lock_acquire (&lock);
+
+  for (e = list_begin (&evicting_list); e != list_end (&evicting_list); )
+    if (list_entry (e, struct page, frame_elem)->owner == t)
+      {
+        cond_wait (&eviction_done, &lock);
+        e = list_begin (&evicting_list);
+      }
+    else
+      e = list_next (e);
+
+  for (e = list_begin (&page_list); e != list_end (&page_list); e = next)
+    {
+      struct page *page = list_entry (e, struct page, frame_elem);
+
+      next = list_next (e);
+      if (page->owner == t)
+        {
+          list_remove (e);
+          page->is_evictable = false;
+        }
+    }
+
+  lock_release (&lock);
+}
+
+/* Waits until PAGE is not being written out.  The frame lock
+   must be held. */
+static void
+wait_for_eviction (struct page *page)
+{
+  ASSERT (lock_held_by_current_thread (&lock));
+
+  while (page->is_evicting)
+    cond_wait (&eviction_done, &lock);
+}
+
+/* Picks a page to evict, unmaps it so that its owner faults
+   instead of modifying it while it is written out, and moves it
+   to evicting_list.  The frame lock must be held. */
 static struct page *
 pop_victim (void)
 {
@@ -92,6 +200,12 @@ pop_victim (void)
     }
 
   ASSERT (!page->is_pinned);
+
+  page->is_evictable = false;
+  page->is_evicting = true;
+  page->is_loaded = false;
+  pagedir_clear_page (page->owner->pagedir, page->uaddr);
+  list_push_back (&evicting_list, &page->frame_elem);
+
   return page;
 }
-
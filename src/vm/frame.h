@@ -6,4 +6,5 @@
 void frame_init (void);
 bool frame_load_page (struct page *page);
 void frame_free_page (struct page *page);
+void frame_release_owner (struct thread *t);
 
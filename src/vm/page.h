@@ -10,6 +10,8 @@ struct page
     bool is_swapped;
     bool is_loaded;
     bool is_pinned;
+    bool is_evictable;          /* In the frame list? */
+    bool is_evicting;           /* Being written out by another thread? */
 
     enum palloc_flags flags;
     void *uaddr;
@@ -18,7 +20,9 @@ struct page
     size_t swap_idx;
 
     struct thread *owner;
-    struct file *file;
+    struct file *file;          /* Mapped file, or a null pointer. */
+    off_t file_ofs;             /* Offset of the page in FILE. */
+    size_t file_bytes;          /* Bytes of FILE in the page; rest is zero. */
 
     struct hash_elem vm_elem;
     struct list_elem frame_elem;
@@ -3,11 +3,12 @@
 #include <stdio.h>
 #include "devices/block.h"
 #include "threads/vaddr.h"
-#include "userprog/pagedir.h"
 #include "filesys/file.h"
 
 #define BLOCK_SECTORS_PER_PAGE (PGSIZE / BLOCK_SECTOR_SIZE)
 
+/* Protects USED_MAP only.  Swap I/O is done without it, so that
+   several pages may be in flight at once. */
 static struct lock lock;
 static struct bitmap *used_map;
 static struct block *block;
@@ -28,63 +29,45 @@ swap_init (void)
 void
 swap_in (struct page *page)
 {
-  lock_acquire (&lock);
-
-  int i;
-
-  for (i = 0; i < BLOCK_SECTORS_PER_PAGE; i++)
-    {
-      block_sector_t sector = page->swap_idx * BLOCK_SECTORS_PER_PAGE + i;
-      void *buffer = page->kaddr + BLOCK_SECTOR_SIZE * i;
-
-      block_read (block, sector, buffer);
-    }
+  block_transfer (block, page->swap_idx * BLOCK_SECTORS_PER_PAGE,
+                  BLOCK_SECTORS_PER_PAGE, page->kaddr, false, BLOCK_TAG_SWAP);
 
+  lock_acquire (&lock);
   bitmap_reset (used_map, page->swap_idx);
+  lock_release (&lock);
 
   page->swap_idx = -1;
   page->is_swapped = false;
-
-  lock_release (&lock);
 }
 
+/* Writes PAGE, already unmapped from its owner, to its file if
+   it is a mapped file page or to a free swap slot otherwise.
+   Leaves PAGE's frame allocated for the caller to reuse. */
 void
 swap_out (struct page *page)
 {
-  lock_acquire (&lock);
-
   if (page->file != NULL && page->file->mapid > 0) // mmap file
-    {
-      int pos = file_tell (page->file);
-
-      file_write (page->file, page->kaddr, PGSIZE);
-      file_seek (page->file, pos);
-    }
+    file_write_at (page->file, page->kaddr, page->file_bytes,
+                   page->file_ofs);
   else
     {
-      size_t swap_idx = bitmap_scan_and_flip (used_map, 0, 1, false);
+      size_t swap_idx;
 
-      int i;
+      lock_acquire (&lock);
+      swap_idx = bitmap_scan_and_flip (used_map, 0, 1, false);
+      lock_release (&lock);
 
-      for (i = 0; i < BLOCK_SECTORS_PER_PAGE; i++)
-        {
-          block_sector_t sector = swap_idx * BLOCK_SECTORS_PER_PAGE + i;
-          const void *buffer = page->kaddr + BLOCK_SECTOR_SIZE * i;
+      if (swap_idx == BITMAP_ERROR)
+        PANIC ("out of swap slots");
 
-          block_write (block, sector, buffer);
-        }
+      block_transfer (block, swap_idx * BLOCK_SECTORS_PER_PAGE,
+                      BLOCK_SECTORS_PER_PAGE, page->kaddr, true,
+                      BLOCK_TAG_SWAP);
 
       page->swap_idx = swap_idx;
     }
 
-  pagedir_clear_page (page->owner->pagedir, page->uaddr);
-  palloc_free_page (page->kaddr);
-
-  page->kaddr = NULL;
-  page->is_loaded = false;
   page->is_swapped = true;
-
-  lock_release (&lock);
 }
 
 void
@@ -40,9 +40,8 @@ vm_unpin_pages (void *upage, off_t size)
 {
   void *uaddr = pg_round_down (upage);
 
-  int num_pages = size / PGSIZE;
-  if (upage != pg_round_down (upage))
-    num_pages++;
+  int num_pages = ((uint8_t *) pg_round_up ((uint8_t *) upage + size)
+                   - (uint8_t *) uaddr) / PGSIZE;
 
   int i;
   for (i = 0; i < num_pages; i++)
@@ -57,9 +56,8 @@ vm_pin_pages (void *upage, off_t size)
 {
   void *uaddr = pg_round_down (upage);
 
-  int num_pages = size / PGSIZE;
-  if (upage != uaddr)
-    num_pages++;
+  int num_pages = ((uint8_t *) pg_round_up ((uint8_t *) upage + size)
+                   - (uint8_t *) uaddr) / PGSIZE;
 
   int i;
   for (i = 0; i < num_pages; i++)
@@ -114,10 +112,14 @@ vm_create_page (enum palloc_flags flags, void *upage, bool writable)
   page->is_loaded = false;
   page->is_swapped = false;
   page->is_pinned = false;
+  page->is_evictable = false;
+  page->is_evicting = false;
 
   page->flags = flags;
   page->uaddr = uaddr;
   page->file = NULL;
+  page->file_ofs = 0;
+  page->file_bytes = 0;
 
   page->owner = thread_current ();
 
@@ -177,26 +179,18 @@ vm_mmap (void *uaddr, struct file *file)
       if (i == 0)
         mapid = _mapid;
 
-      _file->pos = i * PGSIZE;
       _file->mapid = mapid;
       _file->page = page;
 
       page->file = _file;
+      page->file_ofs = i * PGSIZE;
+      page->file_bytes = size - i * PGSIZE < PGSIZE ? size - i * PGSIZE : PGSIZE;
       page->is_loaded = false;
     }
 
   return mapid;
 }
 
-static size_t
-munmap_page_file_length (struct file *page_file)
-{
-  int pos = file_tell (page_file);
-  size_t size = file_length (page_file) - pos;
-
-  return size < PGSIZE ? size : PGSIZE;
-}
-
 void
 vm_munmap (int mapid)
 {
@@ -206,13 +200,12 @@ vm_munmap (int mapid)
     {
       struct page *page = file->page;
 
+      /* Keep the page from being evicted while we write it. */
+      frame_free_page (page);
+
       if (page->is_loaded && pagedir_is_dirty (page->owner->pagedir, page->uaddr))
-        {
-          size_t size = munmap_page_file_length (page->file);
-          file_write (file, page->kaddr, size);
-        }
+        file_write_at (file, page->kaddr, page->file_bytes, page->file_ofs);
 
-      frame_free_page (page);
       hash_delete (&page->owner->vm, &page->vm_elem);
       file_close (file);
 
@@ -231,10 +224,7 @@ vm_munmap_all (void)
       struct page *page = file->page;
 
       if (page->is_loaded && pagedir_is_dirty (page->owner->pagedir, page->uaddr))
-        {
-          size_t size = munmap_page_file_length (page->file);
-          file_write (file, page->kaddr, size);
-        }
+        file_write_at (file, page->kaddr, page->file_bytes, page->file_ofs);
 
       file_close (file);
     }